@@ -110,7 +110,8 @@ int DrmDisplayComposition::Plan(std::vector<DrmPlane *> *primary_planes,
   std::tie(ret,
            composition_planes_) = planner_->ProvisionPlanes(to_composite, crtc_,
                                                             primary_planes,
-                                                            overlay_planes);
+                                                            overlay_planes,
+                                                            &plan_id_);
   if (ret) {
     ALOGE("Planner failed provisioning planes ret=%d", ret);
     return ret;
@@ -22,7 +22,11 @@
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <sstream>
 #include <vector>
 
@@ -34,7 +38,9 @@
 #include "autolock.h"
 #include "drmcrtc.h"
 #include "drmdevice.h"
+#include "drmeventlistener.h"
 #include "drmplane.h"
+#include "platform.h"
 
 static const uint32_t kWaitWritebackFence = 100;  // ms
 
@@ -54,6 +60,57 @@ class CompositorVsyncCallback : public VsyncCallback {
   DrmDisplayCompositor *compositor_;
 };
 
+struct CompositorFlipState {
+  std::mutex lock;
+  std::condition_variable cond;
+  // Sequence numbers of the last nonblocking commit, and of the last one
+  // whose flip is done or was given up on
+  uint64_t committed = 0;
+  uint64_t done = 0;
+  // The shared planes each pending flip disables
+  std::map<uint64_t, std::vector<DrmPlane *>> releases;
+  // The compositions each pending flip takes off the screen
+  std::map<uint64_t, std::unique_ptr<DrmDisplayComposition>> retired;
+  ResourceManager *resource_manager = NULL;
+  int display = -1;
+
+  // Must be called with lock held. The compositions that are off the screen
+  // now are returned, for the caller to free once it let go of lock.
+  std::vector<std::unique_ptr<DrmDisplayComposition>> Complete(uint64_t seq) {
+    done = std::max(done, seq);
+    for (auto it = releases.begin(); it != releases.end() && it->first <= done;
+         it = releases.erase(it))
+      resource_manager->ReleaseSharedPlanes(display, it->second);
+    std::vector<std::unique_ptr<DrmDisplayComposition>> off_screen;
+    for (auto it = retired.begin(); it != retired.end() && it->first <= done;
+         it = retired.erase(it))
+      off_screen.emplace_back(std::move(it->second));
+    cond.notify_all();
+    return off_screen;
+  }
+};
+
+class CompositorFlipHandler : public DrmEventHandler {
+ public:
+  CompositorFlipHandler(std::shared_ptr<CompositorFlipState> state,
+                        uint64_t seq)
+      : state_(state), seq_(seq) {
+  }
+
+  void HandleEvent(uint64_t /*timestamp_us*/) {
+    std::vector<std::unique_ptr<DrmDisplayComposition>> off_screen;
+    std::lock_guard<std::mutex> lock(state_->lock);
+    // The compositor gave up on this flip already
+    if (seq_ <= state_->done)
+      return;
+    off_screen = state_->Complete(seq_);
+  }
+
+ private:
+  std::shared_ptr<CompositorFlipState> state_;
+  uint64_t seq_;
+};
+
 DrmDisplayCompositor::DrmDisplayCompositor()
     : resource_manager_(NULL),
       display_(-1),
@@ -63,7 +120,8 @@ DrmDisplayCompositor::DrmDisplayCompositor()
       dump_frames_composited_(0),
       dump_last_timestamp_ns_(0),
       flatten_countdown_(FLATTEN_COUNTDOWN_INIT),
-      writeback_fence_(-1) {
+      writeback_fence_(-1),
+      flip_state_(std::make_shared<CompositorFlipState>()) {
   struct timespec ts;
   if (clock_gettime(CLOCK_MONOTONIC, &ts))
     return;
@@ -75,6 +133,9 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     return;
 
   vsync_worker_.Exit();
+  // Shared planes are released and the compositions it replaced freed once
+  // the flip is done
+  WaitForFlip();
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
@@ -83,6 +144,8 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     drm->DestroyPropertyBlob(mode_.blob_id);
   if (mode_.old_blob_id)
     drm->DestroyPropertyBlob(mode_.old_blob_id);
+  for (std::pair<const uint32_t, DamageBlob> &blob : damage_blobs_)
+    drm->DestroyPropertyBlob(blob.second.blob_id);
 
   active_composition_.reset();
 
@@ -107,6 +170,8 @@ int DrmDisplayCompositor::Init(ResourceManager *resource_manager, int display) {
     return ret;
   }
   planner_ = Planner::CreateInstance(drm);
+  flip_state_->resource_manager = resource_manager;
+  flip_state_->display = display;
 
   vsync_worker_.Init(drm, display_);
   auto callback = std::make_shared<CompositorVsyncCallback>(this);
@@ -164,15 +229,19 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
     return -ENOMEM;
   }
 
+  std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+  PropertyState pending;
   int ret;
   std::vector<DrmCompositionPlane> &comp_planes = display_comp
                                                       ->composition_planes();
+  std::vector<DrmPlane *> shared_planes;
   for (DrmCompositionPlane &comp_plane : comp_planes) {
     DrmPlane *plane = comp_plane.plane();
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), 0) < 0 ||
-          drmModeAtomicAddProperty(pset, plane->id(), plane->fb_property().id(),
-                                   0) < 0;
+    if (resource_manager_->IsSharedPlane(plane))
+      shared_planes.push_back(plane);
+    PropertyState *state = GetPendingState(plane, &pending);
+    ret = AddProperty(pset, plane->id(), plane->crtc_property(), 0, state) ||
+          AddProperty(pset, plane->id(), plane->fb_property(), 0, state);
     if (ret) {
       ALOGE("Failed to add plane %d disable to pset", plane->id());
       drmModeAtomicFree(pset);
@@ -183,14 +252,137 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
   ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
+    committed_state_.Clear();
     drmModeAtomicFree(pset);
     return ret;
   }
+  committed_state_.Commit(pending);
+  resource_manager_->ReleaseSharedPlanes(display_, shared_planes);
 
   drmModeAtomicFree(pset);
   return 0;
 }
 
+int DrmDisplayCompositor::DisableSharedPlanes() {
+  std::vector<DrmPlane *> planes;
+  for (DrmPlane *plane : resource_manager_->GetSharedPlanes(display_)) {
+    if (resource_manager_->HoldsSharedPlane(display_, plane))
+      planes.push_back(plane);
+  }
+  if (planes.empty())
+    return 0;
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  // Shared planes aren't tracked in the committed state
+  std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+  int ret;
+  for (DrmPlane *plane : planes) {
+    ret = AddProperty(pset, plane->id(), plane->crtc_property(), 0, NULL) ||
+          AddProperty(pset, plane->id(), plane->fb_property(), 0, NULL);
+    if (ret) {
+      ALOGE("Failed to add plane %d disable to pset", plane->id());
+      drmModeAtomicFree(pset);
+      return ret;
+    }
+  }
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  drmModeAtomicFree(pset);
+  if (ret) {
+    ALOGE("Failed to commit pset ret=%d\n", ret);
+    return ret;
+  }
+  resource_manager_->ReleaseSharedPlanes(display_, planes);
+  return 0;
+}
+
+int DrmDisplayCompositor::AddProperty(drmModeAtomicReqPtr pset,
+                                      uint32_t object_id,
+                                      const DrmProperty &property,
+                                      uint64_t value,
+                                      PropertyState *pending) {
+  if (!committed_state_.Changed(object_id, property.id(), value, pending))
+    return 0;
+  int ret = drmModeAtomicAddProperty(pset, object_id, property.id(), value);
+  return ret < 0 ? ret : 0;
+}
+
+DrmDisplayCompositor::PropertyState *DrmDisplayCompositor::GetPendingState(
+    DrmPlane *plane, PropertyState *pending) {
+  return resource_manager_->IsSharedPlane(plane) ? NULL : pending;
+}
+
+void DrmDisplayCompositor::KeepSharedPlanes(
+    const std::vector<DrmPlane *> &planes) {
+  std::lock_guard<std::mutex> lock(flip_state_->lock);
+  for (std::pair<const uint64_t, std::vector<DrmPlane *>> &release :
+       flip_state_->releases) {
+    std::vector<DrmPlane *> &pending = release.second;
+    for (DrmPlane *plane : planes)
+      pending.erase(std::remove(pending.begin(), pending.end(), plane),
+                    pending.end());
+  }
+}
+
+int DrmDisplayCompositor::CommitNonblocking(
+    DrmDevice *drm, drmModeAtomicReqPtr pset, uint32_t flags,
+    const std::vector<DrmPlane *> &disabled_shared_planes) {
+  // The event may arrive before drmModeAtomicCommit returns
+  uint64_t seq;
+  {
+    std::lock_guard<std::mutex> lock(flip_state_->lock);
+    seq = ++flip_state_->committed;
+    if (!disabled_shared_planes.empty())
+      flip_state_->releases[seq] = disabled_shared_planes;
+  }
+  CompositorFlipHandler *handler = new CompositorFlipHandler(flip_state_, seq);
+  int ret = drmModeAtomicCommit(drm->fd(), pset,
+                                flags | DRM_MODE_ATOMIC_NONBLOCK |
+                                    DRM_MODE_PAGE_FLIP_EVENT,
+                                handler);
+  if (ret) {
+    delete handler;
+    // Nothing was disabled, the planes are still ours
+    std::vector<std::unique_ptr<DrmDisplayComposition>> off_screen;
+    std::lock_guard<std::mutex> lock(flip_state_->lock);
+    flip_state_->releases.erase(seq);
+    off_screen = flip_state_->Complete(seq);
+  }
+  return ret;
+}
+
+void DrmDisplayCompositor::WaitForFlip() {
+  ATRACE_CALL();
+
+  std::vector<std::unique_ptr<DrmDisplayComposition>> off_screen;
+  CompositorFlipState &state = *flip_state_;
+  std::unique_lock<std::mutex> lock(state.lock);
+  if (state.cond.wait_for(lock, std::chrono::milliseconds(kFlipTimeoutMs),
+                          [&state] { return state.done == state.committed; }))
+    return;
+
+  // Its handler ignores the event, should it arrive after all
+  ALOGE("Page flip on display %d timed out, assuming it completed", display_);
+  off_screen = state.Complete(state.committed);
+}
+
+bool DrmDisplayCompositor::FlipPending() {
+  std::lock_guard<std::mutex> lock(flip_state_->lock);
+  return flip_state_->done != flip_state_->committed;
+}
+
+void DrmDisplayCompositor::RetireComposition(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  std::lock_guard<std::mutex> lock(flip_state_->lock);
+  if (composition && flip_state_->done != flip_state_->committed)
+    flip_state_->retired[flip_state_->committed] = std::move(composition);
+}
+
 int DrmDisplayCompositor::SetupWritebackCommit(drmModeAtomicReqPtr pset,
                                                uint32_t crtc_id,
                                                DrmConnector *writeback_conn,
@@ -255,12 +447,28 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     return -ENODEV;
   }
 
+  // Only plain frames are committed without waiting for the flip. Modesets
+  // are followed by DPMS and writeback by waiting on its fence anyway, and
+  // the kernel rejects page flip events for a crtc that is off.
+  bool nonblocking = !test_only && !writeback_buffer &&
+                     !mode_.needs_modeset && active_;
+  if (!test_only)
+    WaitForFlip();
+
   drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
   if (!pset) {
     ALOGE("Failed to allocate property set");
     return -ENOMEM;
   }
 
+  // Held until the committed state is updated, test commits must not check
+  // against a state that's about to change under them
+  std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+  PropertyState pending;
+  // The modeset may reset what the planes had, send all of it along
+  if (mode_.needs_modeset)
+    committed_state_.Clear();
+
   if (writeback_buffer != NULL) {
     if (writeback_conn == NULL) {
       ALOGE("Invalid arguments requested writeback without writeback conn");
@@ -284,6 +492,16 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
   }
 
+  if (crtc->background_color_property().id() != 0) {
+    ret = AddProperty(pset, crtc->id(), crtc->background_color_property(),
+                      display_comp->background_color(), &pending);
+    if (ret < 0) {
+      ALOGE("Failed to add BACKGROUND_COLOR property to pset: %d", ret);
+      drmModeAtomicFree(pset);
+      return ret;
+    }
+  }
+
   if (mode_.needs_modeset) {
     ret = drmModeAtomicAddProperty(pset, crtc->id(),
                                    crtc->active_property().id(), 1);
@@ -312,11 +530,13 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
 
     int fb_id = -1;
     int fence_fd = -1;
+    const std::vector<hwc_rect_t> *damage = NULL;
     hwc_rect_t display_frame;
     hwc_frect_t source_crop;
     uint64_t rotation = 0;
     uint64_t alpha = 0xFFFF;
     uint64_t blend;
+    PropertyState *state = GetPendingState(plane, &pending);
 
     if (comp_plane.type() != DrmCompositionPlane::Type::kDisable) {
       if (source_layers.size() > 1) {
@@ -337,27 +557,13 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       }
       fb_id = layer.buffer->fb_id;
       fence_fd = layer.acquire_fence.get();
+      damage = &layer.damage;
       display_frame = layer.display_frame;
       source_crop = layer.source_crop;
       alpha = layer.alpha;
 
-      if (plane->blend_property().id()) {
-        switch (layer.blending) {
-          case DrmHwcBlending::kPreMult:
-            std::tie(blend, ret) = plane->blend_property().GetEnumValueWithName(
-                "Pre-multiplied");
-            break;
-          case DrmHwcBlending::kCoverage:
-            std::tie(blend, ret) = plane->blend_property().GetEnumValueWithName(
-                "Coverage");
-            break;
-          case DrmHwcBlending::kNone:
-          default:
-            std::tie(blend, ret) = plane->blend_property().GetEnumValueWithName(
-                "None");
-            break;
-        }
-      }
+      if (plane->blend_property().id())
+        std::tie(blend, ret) = plane->GetBlendValue(layer.blending);
 
       if (plane->zpos_property().id() &&
           !plane->zpos_property().is_immutable()) {
@@ -366,9 +572,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
         // Ignore ret and use min_zpos as 0 by default
         std::tie(std::ignore, min_zpos) = plane->zpos_property().range_min();
 
-        ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                       plane->zpos_property().id(),
-                                       source_layers.front() + min_zpos) < 0;
+        ret = AddProperty(pset, plane->id(), plane->zpos_property(),
+                          source_layers.front() + min_zpos, state);
         if (ret) {
           ALOGE("Failed to add zpos property %d to plane %d",
                 plane->zpos_property().id(), plane->id());
@@ -376,19 +581,7 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
         }
       }
 
-      rotation = 0;
-      if (layer.transform & DrmHwcTransform::kFlipH)
-        rotation |= DRM_MODE_REFLECT_X;
-      if (layer.transform & DrmHwcTransform::kFlipV)
-        rotation |= DRM_MODE_REFLECT_Y;
-      if (layer.transform & DrmHwcTransform::kRotate90)
-        rotation |= DRM_MODE_ROTATE_90;
-      else if (layer.transform & DrmHwcTransform::kRotate180)
-        rotation |= DRM_MODE_ROTATE_180;
-      else if (layer.transform & DrmHwcTransform::kRotate270)
-        rotation |= DRM_MODE_ROTATE_270;
-      else
-        rotation |= DRM_MODE_ROTATE_0;
+      rotation = layer.GetDrmRotation();
 
       if (fence_fd >= 0) {
         int prop_id = plane->in_fence_fd_property().id();
@@ -406,10 +599,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
 
     // Disable the plane if there's no framebuffer
     if (fb_id < 0) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->crtc_property().id(), 0) < 0 ||
-            drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->fb_property().id(), 0) < 0;
+      ret = AddProperty(pset, plane->id(), plane->crtc_property(), 0, state) ||
+            AddProperty(pset, plane->id(), plane->fb_property(), 0, state);
       if (ret) {
         ALOGE("Failed to add plane %d disable to pset", plane->id());
         break;
@@ -417,47 +608,35 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       continue;
     }
 
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), crtc->id()) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->fb_property().id(), fb_id) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_x_property().id(),
-                                    display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_y_property().id(),
-                                    display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_w_property().id(),
-                                    display_frame.right - display_frame.left) <
-           0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_h_property().id(),
-                                    display_frame.bottom - display_frame.top) <
-           0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_x_property().id(),
-                                    (int)(source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_y_property().id(),
-                                    (int)(source_crop.top) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_w_property().id(),
-                                    (int)(source_crop.right - source_crop.left)
-                                        << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_h_property().id(),
-                                    (int)(source_crop.bottom - source_crop.top)
-                                        << 16) < 0;
+    ret = AddProperty(pset, plane->id(), plane->crtc_property(), crtc->id(),
+                      state) ||
+          AddProperty(pset, plane->id(), plane->fb_property(), fb_id, state) ||
+          AddProperty(pset, plane->id(), plane->crtc_x_property(),
+                      display_frame.left, state) ||
+          AddProperty(pset, plane->id(), plane->crtc_y_property(),
+                      display_frame.top, state) ||
+          AddProperty(pset, plane->id(), plane->crtc_w_property(),
+                      display_frame.right - display_frame.left, state) ||
+          AddProperty(pset, plane->id(), plane->crtc_h_property(),
+                      display_frame.bottom - display_frame.top, state) ||
+          AddProperty(pset, plane->id(), plane->src_x_property(),
+                      (int)(source_crop.left) << 16, state) ||
+          AddProperty(pset, plane->id(), plane->src_y_property(),
+                      (int)(source_crop.top) << 16, state) ||
+          AddProperty(pset, plane->id(), plane->src_w_property(),
+                      (int)(source_crop.right - source_crop.left) << 16,
+                      state) ||
+          AddProperty(pset, plane->id(), plane->src_h_property(),
+                      (int)(source_crop.bottom - source_crop.top) << 16,
+                      state);
     if (ret) {
       ALOGE("Failed to add plane %d to set", plane->id());
       break;
     }
 
     if (plane->rotation_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->rotation_property().id(),
-                                     rotation) < 0;
+      ret = AddProperty(pset, plane->id(), plane->rotation_property(),
+                        rotation, state);
       if (ret) {
         ALOGE("Failed to add rotation property %d to plane %d",
               plane->rotation_property().id(), plane->id());
@@ -466,8 +645,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->alpha_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->alpha_property().id(), alpha) < 0;
+      ret = AddProperty(pset, plane->id(), plane->alpha_property(), alpha,
+                        state);
       if (ret) {
         ALOGE("Failed to add alpha property %d to plane %d",
               plane->alpha_property().id(), plane->id());
@@ -476,14 +655,37 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->blend_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->blend_property().id(), blend) < 0;
+      ret = AddProperty(pset, plane->id(), plane->blend_property(), blend,
+                        state);
       if (ret) {
         ALOGE("Failed to add pixel blend mode property %d to plane %d",
               plane->blend_property().id(), plane->id());
         break;
       }
     }
+
+    // The damage is relative to the layer's last frame, which isn't what the
+    // plane showed if the layers moved around. The kernel drops the damage
+    // after each commit, so no blob means full damage.
+    if (plane->damage_clips_property().id() &&
+        !display_comp->geometry_changed()) {
+      uint32_t blob_id = 0;
+      ret = GetDamageBlob(plane, *damage, &blob_id);
+      if (ret) {
+        ALOGE("Failed to create damage blob for plane %d", plane->id());
+        break;
+      }
+      if (blob_id) {
+        ret = drmModeAtomicAddProperty(pset, plane->id(),
+                                       plane->damage_clips_property().id(),
+                                       blob_id) < 0;
+        if (ret) {
+          ALOGE("Failed to add FB_DAMAGE_CLIPS property %d to plane %d",
+                plane->damage_clips_property().id(), plane->id());
+          break;
+        }
+      }
+    }
   }
 
   if (!ret) {
@@ -491,13 +693,33 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     if (test_only)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm->fd(), pset, flags, drm);
+    // Other displays may only take the shared planes we disable once they're
+    // off the screen, which a nonblocking commit's return doesn't mean
+    std::vector<DrmPlane *> disabled_shared_planes;
+    for (DrmCompositionPlane &comp_plane : comp_planes) {
+      if (comp_plane.type() == DrmCompositionPlane::Type::kDisable &&
+          resource_manager_->IsSharedPlane(comp_plane.plane()))
+        disabled_shared_planes.push_back(comp_plane.plane());
+    }
+
+    if (nonblocking)
+      ret = CommitNonblocking(drm, pset, flags, disabled_shared_planes);
+    else
+      ret = drmModeAtomicCommit(drm->fd(), pset, flags, drm);
     if (ret) {
-      if (!test_only)
+      if (!test_only) {
         ALOGE("Failed to commit pset ret=%d\n", ret);
+        // Such as after losing DRM master, there's no telling what the
+        // kernel has now
+        committed_state_.Clear();
+      }
       drmModeAtomicFree(pset);
       return ret;
     }
+    if (!test_only)
+      committed_state_.Commit(pending);
+    if (!test_only && !nonblocking)
+      resource_manager_->ReleaseSharedPlanes(display_, disabled_shared_planes);
   }
   if (pset)
     drmModeAtomicFree(pset);
@@ -538,6 +760,12 @@ int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
     return -ENODEV;
   }
 
+  // The driver may reset the planes going off or coming back on
+  {
+    std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+    committed_state_.Clear();
+  }
+
   const DrmProperty &prop = conn->dpms_property();
   int ret = drmModeConnectorSetProperty(drm->fd(), conn->id(), prop.id(),
                                         display_comp->dpms_mode());
@@ -566,7 +794,51 @@ std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
   return std::make_tuple(ret, id);
 }
 
+int DrmDisplayCompositor::GetDamageBlob(DrmPlane *plane,
+                                        const std::vector<hwc_rect_t> &damage,
+                                        uint32_t *blob_id) {
+  // No blob at all means the whole framebuffer is damaged
+  *blob_id = 0;
+  if (damage.empty())
+    return 0;
+
+  std::lock_guard<std::mutex> lock(damage_blobs_lock_);
+  auto it = damage_blobs_.find(plane->id());
+  if (it != damage_blobs_.end() && it->second.damage.size() == damage.size() &&
+      !memcmp(it->second.damage.data(), damage.data(),
+              damage.size() * sizeof(hwc_rect_t))) {
+    *blob_id = it->second.blob_id;
+    return 0;
+  }
+
+  std::vector<drm_mode_rect> clips;
+  for (const hwc_rect_t &rect : damage)
+    clips.push_back(drm_mode_rect{rect.left, rect.top, rect.right,
+                                  rect.bottom});
+
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  uint32_t id;
+  int ret = drm->CreatePropertyBlob(clips.data(),
+                                    clips.size() * sizeof(drm_mode_rect), &id);
+  if (ret)
+    return ret;
+
+  // Committed states hold their own reference to the old blob
+  if (it != damage_blobs_.end())
+    drm->DestroyPropertyBlob(it->second.blob_id);
+  damage_blobs_[plane->id()] = DamageBlob{damage, id};
+  *blob_id = id;
+  return 0;
+}
+
 void DrmDisplayCompositor::ClearDisplay() {
+  // The display may have been unplugged or the planes changed by another DRM
+  // master, whatever comes next sends all of its properties
+  {
+    std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+    committed_state_.Clear();
+  }
+
   if (!active_composition_)
     return;
 
@@ -577,19 +849,25 @@ void DrmDisplayCompositor::ClearDisplay() {
   vsync_worker_.VSyncControl(false);
 }
 
-void DrmDisplayCompositor::ApplyFrame(
+int DrmDisplayCompositor::ApplyFrame(
     std::unique_ptr<DrmDisplayComposition> composition, int status,
-    bool writeback) {
+    bool writeback, int *out_fence) {
   AutoLock lock(&lock_, __func__);
-  if (lock.Lock())
-    return;
-  int ret = status;
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  ret = status;
 
   if (!ret) {
     if (writeback && !CountdownExpired()) {
       ALOGE("Abort playing back scene");
-      return;
+      return -EAGAIN;
     }
+    // A cursor move that couldn't be committed on its own goes with the
+    // frame
+    DrmHwcLayer *cursor = GetCursorLayer(composition.get(), NULL);
+    if (cursor_.pending && cursor)
+      MoveCursorLayer(cursor);
     ret = CommitFrame(composition.get(), false);
   }
 
@@ -598,35 +876,147 @@ void DrmDisplayCompositor::ApplyFrame(
     // Disable the hw used by the last active composition. This allows us to
     // signal the release fences from that composition to avoid hanging.
     ClearDisplay();
-    return;
+    return ret;
   }
   ++dump_frames_composited_;
+  if (out_fence)
+    *out_fence = composition->take_out_fence();
 
-  active_composition_.swap(composition);
+  RetireComposition(std::move(active_composition_));
+  active_composition_ = std::move(composition);
 
   flatten_countdown_ = FLATTEN_COUNTDOWN_INIT;
   vsync_worker_.VSyncControl(!writeback);
+  return 0;
+}
+
+DrmHwcLayer *DrmDisplayCompositor::GetCursorLayer(
+    DrmDisplayComposition *composition, DrmCompositionPlane **cursor_plane) {
+  std::vector<DrmHwcLayer> &layers = composition->layers();
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        comp_plane.plane()->type() != DRM_PLANE_TYPE_CURSOR ||
+        comp_plane.source_layers().empty() ||
+        comp_plane.source_layers().front() >= layers.size())
+      continue;
+    if (cursor_plane)
+      *cursor_plane = &comp_plane;
+    return &layers[comp_plane.source_layers().front()];
+  }
+  return NULL;
+}
+
+void DrmDisplayCompositor::MoveCursorLayer(DrmHwcLayer *layer) {
+  hwc_rect_t &frame = layer->display_frame;
+  frame.right = cursor_.x + frame.right - frame.left;
+  frame.bottom = cursor_.y + frame.bottom - frame.top;
+  frame.left = cursor_.x;
+  frame.top = cursor_.y;
+  cursor_.pending = false;
+}
+
+int DrmDisplayCompositor::MoveCursor(int x, int y) {
+  ATRACE_CALL();
+
+  AutoLock lock(&lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  if (!active_composition_ || !GetCursorLayer(active_composition_.get(), NULL))
+    return -ENOENT;
+
+  cursor_.x = x;
+  cursor_.y = y;
+  cursor_.pending = true;
+  return CommitCursor();
+}
+
+int DrmDisplayCompositor::CommitCursor() {
+  DrmCompositionPlane *comp_plane = NULL;
+  DrmHwcLayer *layer = active_composition_
+                           ? GetCursorLayer(active_composition_.get(),
+                                            &comp_plane)
+                           : NULL;
+  if (!layer) {
+    cursor_.pending = false;
+    return -ENOENT;
+  }
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  // The kernel rejects the commit while a flip is in flight. Waiting for it
+  // here would hold up the next frame too, the move goes with the next frame
+  // or on the next vblank instead.
+  if (active_ && FlipPending())
+    return 0;
+
+  // Only the position changes, the framebuffer and everything else stay
+  DrmPlane *plane = comp_plane->plane();
+  std::lock_guard<std::mutex> state_lock(committed_state_lock_);
+  PropertyState pending;
+  PropertyState *state = GetPendingState(plane, &pending);
+  int ret = AddProperty(pset, plane->id(), plane->crtc_x_property(), cursor_.x,
+                        state) ||
+            AddProperty(pset, plane->id(), plane->crtc_y_property(), cursor_.y,
+                        state);
+  if (ret) {
+    ALOGE("Failed to add cursor position to plane %d", plane->id());
+    drmModeAtomicFree(pset);
+    return -EINVAL;
+  }
+
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  if (active_)
+    ret = CommitNonblocking(drm, pset, 0, std::vector<DrmPlane *>());
+  else
+    ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  drmModeAtomicFree(pset);
+  // Still pending, it's retried along with the next frame or vblank
+  if (ret == -EBUSY)
+    return 0;
+  if (ret) {
+    committed_state_.Clear();
+    return ret;
+  }
+  committed_state_.Commit(pending);
+
+  // Keep the active composition in sync for the next full commit
+  MoveCursorLayer(layer);
+  return 0;
 }
 
 int DrmDisplayCompositor::ApplyComposition(
-    std::unique_ptr<DrmDisplayComposition> composition) {
+    std::unique_ptr<DrmDisplayComposition> composition, int *out_fence) {
   int ret = 0;
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
-      if (composition->geometry_changed()) {
+      if (composition->geometry_changed() && !composition->tested()) {
         // Send the composition to the kernel to ensure we can commit it. This
         // is just a test, it won't actually commit the frame.
-        ret = CommitFrame(composition.get(), true);
+        ret = TestComposition(composition.get());
         if (ret) {
           ALOGE("Commit test failed for display %d, FIXME", display_);
           return ret;
         }
       }
 
-      ApplyFrame(std::move(composition), ret);
+      ret = ApplyFrame(std::move(composition), ret, false, out_fence);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
       active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
+      if (!active_) {
+        // Other displays may use the shared planes while we're off
+        WaitForFlip();
+        ret = DisableSharedPlanes();
+        if (ret)
+          ALOGE("Failed to release the shared planes of display %d",
+                display_);
+      }
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
@@ -652,7 +1042,25 @@ int DrmDisplayCompositor::ApplyComposition(
 }
 
 int DrmDisplayCompositor::TestComposition(DrmDisplayComposition *composition) {
-  return CommitFrame(composition, true);
+  // The same stack may have passed on the same planes before
+  Planner *planner = composition->planner();
+  if (planner && composition->plan_id() &&
+      planner->TestPassed(composition->plan_id())) {
+    composition->set_tested(true);
+    return 0;
+  }
+
+  // Flattening may be committing from the vsync thread meanwhile
+  AutoLock lock(&lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  ret = CommitFrame(composition, true);
+  lock.Unlock();
+  composition->set_tested(!ret);
+  if (!ret && planner && composition->plan_id())
+    planner->SetTestPassed(composition->plan_id());
+  return ret;
 }
 
 // Flatten a scene on the display by using a writeback connector
@@ -692,12 +1100,10 @@ int DrmDisplayCompositor::FlattenOnDisplay(
     ALOGE("Failed to find crtc for display %d", display_);
     return -EINVAL;
   }
-  // TODO what happens if planes could go to both CRTCs, I don't think it's
-  // handled anywhere
   std::vector<DrmPlane *> primary_planes;
   std::vector<DrmPlane *> overlay_planes;
   for (auto &plane : drm->planes()) {
-    if (!plane->GetCrtcSupported(*crtc))
+    if (!plane->GetCrtcSupported(*crtc) || !CanUsePlane(plane.get()))
       continue;
     if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
       primary_planes.push_back(plane.get());
@@ -837,7 +1243,7 @@ int DrmDisplayCompositor::FlattenSerial(DrmConnector *writeback_conn) {
   DrmCompositionPlane squashed_comp(DrmCompositionPlane::Type::kLayer, NULL,
                                     crtc);
   for (auto &drmplane : drm->planes()) {
-    if (!drmplane->GetCrtcSupported(*crtc))
+    if (!drmplane->GetCrtcSupported(*crtc) || !CanUsePlane(drmplane.get()))
       continue;
     if (!squashed_comp.plane() && drmplane->type() == DRM_PLANE_TYPE_PRIMARY)
       squashed_comp.set_plane(drmplane.get());
@@ -890,6 +1296,15 @@ int DrmDisplayCompositor::FlattenConcurrent(DrmConnector *writeback_conn) {
   }
   DrmCrtc *crtc = active_composition_->crtc();
 
+  // Fill buffers and the background color only exist on this CRTC's device
+  std::vector<DrmHwcLayer> &active_layers = active_composition_->layers();
+  if (active_composition_->background_color() != kDefaultBackgroundColor ||
+      std::any_of(active_layers.begin(), active_layers.end(),
+                  [](const DrmHwcLayer &layer) { return layer.solid_color; })) {
+    ALOGV("Can't flatten solid color layers on another display");
+    return -EOPNOTSUPP;
+  }
+
   std::vector<DrmHwcLayer> copy_layers;
   for (DrmHwcLayer &src_layer : active_composition_->layers()) {
     DrmHwcLayer copy;
@@ -921,7 +1336,7 @@ int DrmDisplayCompositor::FlattenConcurrent(DrmConnector *writeback_conn) {
   DrmCompositionPlane squashed_comp(DrmCompositionPlane::Type::kLayer, NULL,
                                     crtc);
   for (auto &drmplane : resource_manager_->GetDrmDevice(display_)->planes()) {
-    if (!drmplane->GetCrtcSupported(*crtc))
+    if (!drmplane->GetCrtcSupported(*crtc) || !CanUsePlane(drmplane.get()))
       continue;
     if (drmplane->type() == DRM_PLANE_TYPE_PRIMARY)
       squashed_comp.set_plane(drmplane.get());
@@ -968,6 +1383,12 @@ int DrmDisplayCompositor::FlattenActiveComposition() {
   return 0;
 }
 
+bool DrmDisplayCompositor::CanUsePlane(DrmPlane *plane) {
+  // Shared planes may be showing another display's layers
+  return !resource_manager_->IsSharedPlane(plane) ||
+         resource_manager_->HoldsSharedPlane(display_, plane);
+}
+
 bool DrmDisplayCompositor::CountdownExpired() const {
   return flatten_countdown_ <= 0;
 }
@@ -976,6 +1397,12 @@ void DrmDisplayCompositor::Vsync(int display, int64_t timestamp) {
   AutoLock lock(&lock_, __func__);
   if (lock.Lock())
     return;
+  // The flip that held up the last cursor move is done by now
+  if (cursor_.pending) {
+    int ret = CommitCursor();
+    if (ret)
+      ALOGE("Failed to move the cursor %d", ret);
+  }
   flatten_countdown_--;
   if (!CountdownExpired())
     return;
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-buffer-reaper"
+
+#include "drmbufferreaper.h"
+#include "platform.h"
+
+#include <errno.h>
+
+#include <hardware/hardware.h>
+#include <log/log.h>
+
+namespace android {
+
+DrmBufferReaper::DrmBufferReaper()
+    : Worker("drm-buffer-reaper", HAL_PRIORITY_URGENT_DISPLAY), head_(NULL) {
+}
+
+DrmBufferReaper::~DrmBufferReaper() {
+  Exit();
+  ReleaseQueued();
+}
+
+int DrmBufferReaper::Init() {
+  return InitWorker();
+}
+
+void DrmBufferReaper::Queue(Importer *importer, hwc_drm_bo_t *bo) {
+  Queue([importer, bo] {
+    int ret = importer->ReleaseBuffer(bo);
+    if (ret)
+      ALOGE("Failed to release buffer %d", ret);
+    delete bo;
+  });
+}
+
+void DrmBufferReaper::Queue(std::function<void()> release) {
+  Node *node = new Node{std::move(release), NULL};
+  Node *head = head_.load(std::memory_order_relaxed);
+  do {
+    node->next = head;
+  } while (!head_.compare_exchange_weak(head, node, std::memory_order_release,
+                                        std::memory_order_relaxed));
+
+  // A non-empty queue means the worker has yet to pick it up, and will take
+  // this buffer along with the others
+  if (head)
+    return;
+
+  Lock();
+  Signal();
+  Unlock();
+}
+
+void DrmBufferReaper::ReleaseQueued() {
+  Node *node = head_.exchange(NULL, std::memory_order_acquire);
+
+  // Release in the order the buffers were queued
+  Node *reversed = NULL;
+  while (node) {
+    Node *next = node->next;
+    node->next = reversed;
+    reversed = node;
+    node = next;
+  }
+
+  while (reversed) {
+    Node *next = reversed->next;
+    reversed->release();
+    delete reversed;
+    reversed = next;
+  }
+}
+
+void DrmBufferReaper::Routine() {
+  Lock();
+  if (!head_.load(std::memory_order_acquire)) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR) {
+      Unlock();
+      return;
+    }
+  }
+  Unlock();
+
+  ReleaseQueued();
+}
+}  // namespace android
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "drmcommittedstate.h"
+
+namespace android {
+
+bool DrmCommittedState::Changed(uint32_t object_id, uint32_t property_id,
+                                uint64_t value, PropertyMap *pending) const {
+  if (!pending)
+    return true;
+
+  auto key = std::make_pair(object_id, property_id);
+  auto it = values_.find(key);
+  if (it != values_.end() && it->second == value)
+    return false;
+  (*pending)[key] = value;
+  return true;
+}
+
+void DrmCommittedState::Commit(const PropertyMap &pending) {
+  for (const auto &property : pending)
+    values_[property.first] = property.second;
+}
+
+void DrmCommittedState::Clear() {
+  values_.clear();
+}
+}  // namespace android
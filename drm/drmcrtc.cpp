@@ -48,6 +48,11 @@ int DrmCrtc::Init() {
     ALOGE("Failed to get OUT_FENCE_PTR property");
     return ret;
   }
+
+  ret = drm_->GetCrtcProperty(*this, "BACKGROUND_COLOR",
+                              &background_color_property_);
+  if (ret)
+    ALOGI("Could not get BACKGROUND_COLOR property");
   return 0;
 }
 
@@ -82,4 +87,8 @@ const DrmProperty &DrmCrtc::mode_property() const {
 const DrmProperty &DrmCrtc::out_fence_ptr_property() const {
   return out_fence_ptr_property_;
 }
+
+const DrmProperty &DrmCrtc::background_color_property() const {
+  return background_color_property_;
+}
 }  // namespace android
@@ -119,12 +119,15 @@ void DrmEventListener::UEventHandler() {
 }
 
 void DrmEventListener::Routine() {
+  // select() leaves only the ready fds in the set it's given
+  fd_set fds;
   int ret;
   do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
+    fds = fds_;
+    ret = select(max_fd_ + 1, &fds, NULL, NULL, NULL);
   } while (ret == -1 && errno == EINTR);
 
-  if (FD_ISSET(drm_->fd(), &fds_)) {
+  if (FD_ISSET(drm_->fd(), &fds)) {
     drmEventContext event_context =
         {.version = 2,
          .vblank_handler = NULL,
@@ -132,7 +135,7 @@ void DrmEventListener::Routine() {
     drmHandleEvent(drm_->fd(), &event_context);
   }
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
+  if (FD_ISSET(uevent_fd_.get(), &fds))
     UEventHandler();
 }
 }  // namespace android
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-fill-buffer-pool"
+
+#include "drmfillbufferpool.h"
+#include "drmbufferreaper.h"
+#include "drmdevice.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <drm/drm_fourcc.h>
+#include <log/log.h>
+#include <system/graphics.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace android {
+
+DrmFillBufferPool::DrmFillBufferPool(DrmDevice *drm, DrmBufferReaper *reaper,
+                                     size_t max_buffers)
+    : drm_(drm), reaper_(reaper), max_buffers_(max_buffers) {
+}
+
+int DrmFillBufferPool::GetBuffer(uint32_t pixel, uint32_t width,
+                                 uint32_t height,
+                                 std::shared_ptr<hwc_drm_bo> *bo) {
+  // A larger buffer of the same color does too, only part of it is shown
+  for (auto it = buffers_.begin(); it != buffers_.end(); ++it) {
+    if (it->first != pixel || it->second->width < width ||
+        it->second->height < height)
+      continue;
+    buffers_.splice(buffers_.begin(), buffers_, it);
+    *bo = it->second;
+    return 0;
+  }
+
+  int ret = CreateBuffer(pixel, width, height, bo);
+  if (ret)
+    return ret;
+
+  buffers_.emplace_front(pixel, *bo);
+  if (buffers_.size() > max_buffers_)
+    buffers_.pop_back();
+  return 0;
+}
+
+int DrmFillBufferPool::CreateBuffer(uint32_t pixel, uint32_t width,
+                                    uint32_t height,
+                                    std::shared_ptr<hwc_drm_bo> *bo) {
+  int fd = drm_->fd();
+
+  struct drm_mode_create_dumb create;
+  memset(&create, 0, sizeof(create));
+  create.width = width;
+  create.height = height;
+  create.bpp = 32;
+  int ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+  if (ret) {
+    ALOGE("Failed to create fill buffer %d", errno);
+    return -errno;
+  }
+
+  struct drm_mode_destroy_dumb destroy;
+  memset(&destroy, 0, sizeof(destroy));
+  destroy.handle = create.handle;
+
+  struct drm_mode_map_dumb map;
+  memset(&map, 0, sizeof(map));
+  map.handle = create.handle;
+  ret = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+  if (ret) {
+    ret = -errno;
+    ALOGE("Failed to map fill buffer %d", ret);
+    drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    return ret;
+  }
+
+  void *addr = mmap(NULL, create.size, PROT_WRITE, MAP_SHARED, fd, map.offset);
+  if (addr == MAP_FAILED) {
+    ret = -errno;
+    ALOGE("Failed to mmap fill buffer %d", ret);
+    drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    return ret;
+  }
+  for (uint32_t y = 0; y < height; ++y) {
+    uint32_t *row = reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(addr) +
+                                                 y * create.pitch);
+    for (uint32_t x = 0; x < width; ++x)
+      row[x] = pixel;
+  }
+  munmap(addr, create.size);
+
+  hwc_drm_bo_t *new_bo = new hwc_drm_bo_t;
+  memset(new_bo, 0, sizeof(*new_bo));
+  new_bo->width = width;
+  new_bo->height = height;
+  new_bo->format = DRM_FORMAT_ARGB8888;
+  new_bo->hal_format = HAL_PIXEL_FORMAT_BGRA_8888;
+  new_bo->pixel_stride = create.pitch / 4;
+  new_bo->pitches[0] = create.pitch;
+  new_bo->gem_handles[0] = create.handle;
+  new_bo->modifiers[0] = DRM_FORMAT_MOD_INVALID;
+  new_bo->acquire_fence_fd = -1;
+  ret = drmModeAddFB2(fd, new_bo->width, new_bo->height, new_bo->format,
+                      new_bo->gem_handles, new_bo->pitches, new_bo->offsets,
+                      &new_bo->fb_id, 0);
+  if (ret) {
+    ALOGE("Failed to add fill framebuffer %d", ret);
+    drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    delete new_bo;
+    return ret;
+  }
+
+  DrmBufferReaper *reaper = reaper_;
+  bo->reset(new_bo, [fd, reaper](hwc_drm_bo_t *bo) {
+    // Like imported buffers, RmFB may block until the buffer left scanout
+    auto release = [fd, bo] {
+      drmModeRmFB(fd, bo->fb_id);
+      struct drm_mode_destroy_dumb destroy;
+      memset(&destroy, 0, sizeof(destroy));
+      destroy.handle = bo->gem_handles[0];
+      drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+      delete bo;
+    };
+    if (reaper)
+      reaper->Queue(release);
+    else
+      release();
+  });
+  return 0;
+}
+}  // namespace android
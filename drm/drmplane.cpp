@@ -18,18 +18,23 @@
 
 #include "drmplane.h"
 #include "drmdevice.h"
+#include "drmhwcomposer.h"
 
 #include <errno.h>
 #include <stdint.h>
 #include <cinttypes>
 
+#include <drm/drm_fourcc.h>
 #include <log/log.h>
 #include <xf86drmMode.h>
 
 namespace android {
 
 DrmPlane::DrmPlane(DrmDevice *drm, drmModePlanePtr p)
-    : drm_(drm), id_(p->plane_id), possible_crtc_mask_(p->possible_crtcs) {
+    : drm_(drm),
+      id_(p->plane_id),
+      possible_crtc_mask_(p->possible_crtcs),
+      formats_(p->formats, p->formats + p->count_formats) {
 }
 
 int DrmPlane::Init() {
@@ -125,22 +130,99 @@ int DrmPlane::Init() {
   ret = drm_->GetPlaneProperty(*this, "rotation", &rotation_property_);
   if (ret)
     ALOGE("Could not get rotation property");
+  else if (rotation_property_.GetBitmask())
+    rotations_ = rotation_property_.GetBitmask();
 
   ret = drm_->GetPlaneProperty(*this, "alpha", &alpha_property_);
   if (ret)
     ALOGI("Could not get alpha property");
 
   ret = drm_->GetPlaneProperty(*this, "pixel blend mode", &blend_property_);
-  if (ret)
+  if (ret) {
     ALOGI("Could not get pixel blend mode property");
+  } else {
+    static const std::pair<DrmHwcBlending, const char *> kBlendNames[] = {
+        {DrmHwcBlending::kNone, "None"},
+        {DrmHwcBlending::kPreMult, "Pre-multiplied"},
+        {DrmHwcBlending::kCoverage, "Coverage"},
+    };
+    for (const auto &blend : kBlendNames) {
+      uint64_t value;
+      int err;
+      std::tie(value, err) = blend_property_.GetEnumValueWithName(blend.second);
+      if (!err)
+        blend_values_[blend.first] = value;
+    }
+  }
 
   ret = drm_->GetPlaneProperty(*this, "IN_FENCE_FD", &in_fence_fd_property_);
   if (ret)
     ALOGI("Could not get IN_FENCE_FD property");
 
+  ret = drm_->GetPlaneProperty(*this, "FB_DAMAGE_CLIPS",
+                               &damage_clips_property_);
+  if (ret)
+    ALOGI("Could not get FB_DAMAGE_CLIPS property");
+
+  DrmProperty in_formats;
+  ret = drm_->GetPlaneProperty(*this, "IN_FORMATS", &in_formats);
+  if (ret)
+    ALOGI("Could not get IN_FORMATS property");
+  else if (ParseInFormats(in_formats))
+    ALOGE("Failed to parse IN_FORMATS for plane %u", id());
+
   return 0;
 }
 
+int DrmPlane::ParseInFormats(const DrmProperty &in_formats) {
+  int ret;
+  uint64_t blob_id;
+  std::tie(ret, blob_id) = in_formats.value();
+  if (ret)
+    return ret;
+
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), blob_id);
+  if (!blob)
+    return -ENOENT;
+
+  auto header = static_cast<struct drm_format_modifier_blob *>(blob->data);
+  if (header->version != FORMAT_BLOB_CURRENT) {
+    drmModeFreePropertyBlob(blob);
+    return -EINVAL;
+  }
+
+  auto formats = reinterpret_cast<uint32_t *>(
+      static_cast<uint8_t *>(blob->data) + header->formats_offset);
+  auto modifiers = reinterpret_cast<struct drm_format_modifier *>(
+      static_cast<uint8_t *>(blob->data) + header->modifiers_offset);
+
+  // Each modifier covers up to 64 formats starting at its offset
+  for (uint32_t i = 0; i < header->count_modifiers; ++i) {
+    for (uint32_t j = 0; j < 64; ++j) {
+      uint32_t index = modifiers[i].offset + j;
+      if (index >= header->count_formats)
+        break;
+      if (modifiers[i].formats & (1ULL << j))
+        format_modifiers_.emplace(formats[index], modifiers[i].modifier);
+    }
+  }
+
+  drmModeFreePropertyBlob(blob);
+  return 0;
+}
+
+bool DrmPlane::IsRotationSupported(uint64_t rotation) const {
+  return (rotation & rotations_) == rotation;
+}
+
+std::tuple<uint64_t, int> DrmPlane::GetBlendValue(
+    DrmHwcBlending blending) const {
+  auto it = blend_values_.find(blending);
+  if (it == blend_values_.end())
+    return std::make_tuple(UINT64_MAX, -EINVAL);
+  return std::make_tuple(it->second, 0);
+}
+
 uint32_t DrmPlane::id() const {
   return id_;
 }
@@ -153,6 +235,18 @@ uint32_t DrmPlane::type() const {
   return type_;
 }
 
+bool DrmPlane::IsFormatSupported(uint32_t format) const {
+  return formats_.count(format) != 0;
+}
+
+bool DrmPlane::IsFormatSupported(uint32_t format, uint64_t modifier) const {
+  // Without IN_FORMATS the plane can only be assumed to take linear buffers
+  if (format_modifiers_.empty())
+    return modifier == DRM_FORMAT_MOD_LINEAR && IsFormatSupported(format);
+
+  return format_modifiers_.count(std::make_pair(format, modifier)) != 0;
+}
+
 const DrmProperty &DrmPlane::crtc_property() const {
   return crtc_property_;
 }
@@ -212,4 +306,8 @@ const DrmProperty &DrmPlane::blend_property() const {
 const DrmProperty &DrmPlane::in_fence_fd_property() const {
   return in_fence_fd_property_;
 }
+
+const DrmProperty &DrmPlane::damage_clips_property() const {
+  return damage_clips_property_;
+}
 }  // namespace android
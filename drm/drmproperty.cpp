@@ -131,4 +131,13 @@ std::tuple<uint64_t, int> DrmProperty::GetEnumValueWithName(
 
   return std::make_tuple(UINT64_MAX, -EINVAL);
 }
+
+uint64_t DrmProperty::GetBitmask() const {
+  uint64_t mask = 0;
+  for (const DrmPropertyEnum &it : enums_) {
+    if (it.value_ < 64)
+      mask |= 1ULL << it.value_;
+  }
+  return mask;
+}
 }  // namespace android
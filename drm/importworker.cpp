@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-import-worker"
+
+#include "importworker.h"
+#include "drmbuffercache.h"
+#include "drmhwcomposer.h"
+
+#include <errno.h>
+
+#include <hardware/hardware.h>
+#include <log/log.h>
+
+namespace android {
+
+ImportWorker::ImportWorker()
+    : Worker("import-worker", HAL_PRIORITY_URGENT_DISPLAY) {
+}
+
+ImportWorker::~ImportWorker() {
+  Exit();
+  for (Request &request : queue_)
+    FreeHandle(request.handle);
+}
+
+int ImportWorker::Init(std::shared_ptr<DrmBufferCache> cache) {
+  cache_ = cache;
+  return InitWorker();
+}
+
+void ImportWorker::FreeHandle(native_handle_t *handle) {
+  native_handle_close(handle);
+  native_handle_delete(handle);
+}
+
+int ImportWorker::Queue(buffer_handle_t handle, const void *owner) {
+  // SurfaceFlinger may free its handle as soon as the next buffer arrives,
+  // keep our own fds open until the import is done
+  native_handle_t *clone = native_handle_clone(handle);
+  if (!clone) {
+    ALOGE("Failed to clone buffer handle");
+    return -ENOMEM;
+  }
+
+  Lock();
+  bool replaced = false;
+  for (Request &request : queue_) {
+    if (request.owner != owner)
+      continue;
+    FreeHandle(request.handle);
+    request.handle = clone;
+    replaced = true;
+    break;
+  }
+  if (!replaced)
+    queue_.push_back(Request{clone, owner});
+  Signal();
+  Unlock();
+  return 0;
+}
+
+void ImportWorker::Cancel(const void *owner) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto it = queue_.begin(); it != queue_.end();) {
+    if (it->owner != owner) {
+      ++it;
+      continue;
+    }
+    FreeHandle(it->handle);
+    it = queue_.erase(it);
+  }
+  cond_.wait(lock, [&] { return importing_ != owner; });
+}
+
+void ImportWorker::Routine() {
+  Lock();
+  if (queue_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || queue_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+  Request request = queue_.front();
+  queue_.pop_front();
+  importing_ = request.owner;
+  Unlock();
+
+  // Only the side effect of filling the cache matters, the composition picks
+  // up the imported buffer from there
+  std::shared_ptr<hwc_drm_bo_t> bo;
+  DrmHwcNativeHandle native_handle;
+  int ret = cache_->ImportBuffer(request.handle, request.owner, &bo,
+                                 &native_handle);
+  if (ret)
+    ALOGV("Failed to import buffer ahead of composition %d", ret);
+  FreeHandle(request.handle);
+
+  Lock();
+  importing_ = NULL;
+  Signal();
+  Unlock();
+}
+}  // namespace android
@@ -66,12 +66,139 @@ int ResourceManager::AddDrmDevice(std::string path) {
     ALOGE("Failed to create importer instance");
     return -ENODEV;
   }
+  std::unique_ptr<DrmBufferReaper> reaper = std::make_unique<DrmBufferReaper>();
+  ret = reaper->Init();
+  if (ret) {
+    ALOGE("Failed to initialize buffer reaper %d", ret);
+    return ret;
+  }
+  char cache_size_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.buffer_cache_size", cache_size_prop, "32");
+  buffer_caches_.emplace_back(
+      std::make_shared<DrmBufferCache>(importer.get(), reaper.get(),
+                                       strtoul(cache_size_prop, NULL, 10)));
+  reapers_.emplace_back(std::move(reaper));
   importers_.push_back(importer);
+  FindSharedPlanes(drm.get(), num_displays_, displays_added);
   drms_.push_back(std::move(drm));
   num_displays_ += displays_added;
   return ret;
 }
 
+void ResourceManager::FindSharedPlanes(DrmDevice *drm, int first_display,
+                                       int num_displays) {
+  char share_planes_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.share_planes", share_planes_prop, "1");
+  if (!atoi(share_planes_prop))
+    return;
+
+  std::vector<DrmPlane *> planes;
+  for (auto &plane : drm->planes()) {
+    if (plane->type() != DRM_PLANE_TYPE_OVERLAY)
+      continue;
+
+    std::vector<int> displays;
+    for (int display = first_display; display < first_display + num_displays;
+         ++display) {
+      DrmCrtc *crtc = drm->GetCrtcForDisplay(display);
+      if (crtc && plane->GetCrtcSupported(*crtc))
+        displays.push_back(display);
+    }
+    if (displays.size() < 2)
+      continue;
+
+    ALOGI("Overlay plane %u is shared between %zu displays", plane->id(),
+          displays.size());
+    planes.push_back(plane.get());
+  }
+  if (planes.empty())
+    return;
+
+  // Whatever the planes show at boot goes, they start out free for any
+  // display to take
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return;
+  }
+  int ret = 0;
+  for (DrmPlane *plane : planes) {
+    ret = drmModeAtomicAddProperty(pset, plane->id(),
+                                   plane->crtc_property().id(), 0) < 0 ||
+          drmModeAtomicAddProperty(pset, plane->id(),
+                                   plane->fb_property().id(), 0) < 0;
+    if (ret) {
+      ALOGE("Failed to add plane %d disable to pset", plane->id());
+      break;
+    }
+  }
+  if (!ret)
+    ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  drmModeAtomicFree(pset);
+  if (ret) {
+    ALOGE("Failed to disable the shared planes %d, not sharing them", ret);
+    return;
+  }
+
+  for (DrmPlane *plane : planes)
+    shared_planes_.emplace(plane, SharedPlane{drm, -1});
+}
+
+bool ResourceManager::IsSharedPlane(DrmPlane *plane) {
+  std::lock_guard<std::mutex> lock(shared_planes_lock_);
+  return shared_planes_.count(plane);
+}
+
+bool ResourceManager::HoldsSharedPlane(int display, DrmPlane *plane) {
+  std::lock_guard<std::mutex> lock(shared_planes_lock_);
+  auto it = shared_planes_.find(plane);
+  return it != shared_planes_.end() && it->second.holder == display;
+}
+
+std::vector<DrmPlane *> ResourceManager::GetSharedPlanes(int display) {
+  std::vector<DrmPlane *> planes;
+  DrmDevice *drm = GetDrmDevice(display);
+  DrmCrtc *crtc = drm ? drm->GetCrtcForDisplay(display) : NULL;
+  if (!crtc)
+    return planes;
+
+  std::lock_guard<std::mutex> lock(shared_planes_lock_);
+  for (std::pair<DrmPlane *const, SharedPlane> &plane : shared_planes_) {
+    if (plane.second.drm != drm || !plane.first->GetCrtcSupported(*crtc))
+      continue;
+    if (plane.second.holder == -1 || plane.second.holder == display)
+      planes.push_back(plane.first);
+  }
+  return planes;
+}
+
+int ResourceManager::ClaimSharedPlanes(int display,
+                                       const std::vector<DrmPlane *> &planes) {
+  std::lock_guard<std::mutex> lock(shared_planes_lock_);
+  for (DrmPlane *plane : planes) {
+    auto it = shared_planes_.find(plane);
+    if (it != shared_planes_.end() && it->second.holder != -1 &&
+        it->second.holder != display)
+      return -EBUSY;
+  }
+  for (DrmPlane *plane : planes) {
+    auto it = shared_planes_.find(plane);
+    if (it != shared_planes_.end())
+      it->second.holder = display;
+  }
+  return 0;
+}
+
+void ResourceManager::ReleaseSharedPlanes(
+    int display, const std::vector<DrmPlane *> &planes) {
+  std::lock_guard<std::mutex> lock(shared_planes_lock_);
+  for (DrmPlane *plane : planes) {
+    auto it = shared_planes_.find(plane);
+    if (it != shared_planes_.end() && it->second.holder == display)
+      it->second.holder = -1;
+  }
+}
+
 DrmConnector *ResourceManager::AvailableWritebackConnector(int display) {
   DrmDevice *drm_device = GetDrmDevice(display);
   DrmConnector *writeback_conn = NULL;
@@ -106,6 +233,22 @@ std::shared_ptr<Importer> ResourceManager::GetImporter(int display) {
   return NULL;
 }
 
+std::shared_ptr<DrmBufferCache> ResourceManager::GetBufferCache(int display) {
+  for (unsigned int i = 0; i < drms_.size(); i++) {
+    if (drms_[i]->HandlesDisplay(display))
+      return buffer_caches_[i];
+  }
+  return NULL;
+}
+
+DrmBufferReaper *ResourceManager::GetBufferReaper(int display) {
+  for (unsigned int i = 0; i < drms_.size(); i++) {
+    if (drms_[i]->HandlesDisplay(display))
+      return reapers_[i].get();
+  }
+  return NULL;
+}
+
 const gralloc_module_t *ResourceManager::gralloc() {
   return gralloc_;
 }
@@ -24,6 +24,9 @@
 #include "vsyncworker.h"
 
 #include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <string>
 
 #include <cutils/properties.h>
@@ -74,9 +77,11 @@ HWC2::Error DrmHwcTwo::CreateDisplay(hwc2_display_t displ,
     ALOGE("Failed to get crtc for display %d", static_cast<int>(displ));
     return HWC2::Error::BadDisplay;
   }
+  // Planes other displays could use as well are lent out per frame instead
   std::vector<DrmPlane *> display_planes;
   for (auto &plane : drm->planes()) {
-    if (plane->GetCrtcSupported(*crtc))
+    if (plane->GetCrtcSupported(*crtc) &&
+        !resource_manager_.IsSharedPlane(plane.get()))
       display_planes.push_back(plane.get());
   }
   displays_.at(displ).Init(&display_planes);
@@ -188,6 +193,9 @@ DrmHwcTwo::HwcDisplay::HwcDisplay(ResourceManager *resource_manager,
 
 void DrmHwcTwo::HwcDisplay::ClearDisplay() {
   compositor_.ClearDisplay();
+  // The display was unplugged, whatever comes back may not take the same
+  // plans
+  planner_->ClearPlanCache();
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
@@ -197,6 +205,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     ALOGE("Failed to create planner instance for composition");
     return HWC2::Error::NoResources;
   }
+  fill_buffers_ = std::make_unique<DrmFillBufferPool>(
+      drm_, resource_manager_->GetBufferReaper(static_cast<int>(handle_)));
 
   int display = static_cast<int>(handle_);
   int ret = compositor_.Init(resource_manager_, display);
@@ -205,18 +215,46 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::NoResources;
   }
 
+  buffer_cache_ = resource_manager_->GetBufferCache(display);
+  if (!buffer_cache_) {
+    ALOGE("Failed to get buffer cache for display %d", display);
+    return HWC2::Error::NoResources;
+  }
+
+  ret = import_worker_.Init(buffer_cache_);
+  if (ret) {
+    ALOGE("Failed to create import worker for d=%d %d", display, ret);
+    return HWC2::Error::NoResources;
+  }
+
   // Split up the given display planes into primary and overlay to properly
   // interface with the composition
   char use_overlay_planes_prop[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.use_overlay_planes", use_overlay_planes_prop, "1");
-  bool use_overlay_planes = atoi(use_overlay_planes_prop);
+  use_overlay_planes_ = atoi(use_overlay_planes_prop);
+  char use_cursor_plane_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_cursor_plane", use_cursor_plane_prop, "1");
+  bool use_cursor_plane = atoi(use_cursor_plane_prop);
   for (auto &plane : *planes) {
     if (plane->type() == DRM_PLANE_TYPE_PRIMARY)
       primary_planes_.push_back(plane);
-    else if (use_overlay_planes && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
+    else if (use_overlay_planes_ && (plane)->type() == DRM_PLANE_TYPE_OVERLAY)
       overlay_planes_.push_back(plane);
+    else if (use_cursor_plane && plane->type() == DRM_PLANE_TYPE_CURSOR)
+      cursor_planes_.push_back(plane);
   }
 
+  // Legacy cursors are 64x64, drivers only report the size if it differs
+  uint64_t cursor_size;
+  if (!drmGetCap(drm_->fd(), DRM_CAP_CURSOR_WIDTH, &cursor_size))
+    cursor_width_ = cursor_size;
+  if (!drmGetCap(drm_->fd(), DRM_CAP_CURSOR_HEIGHT, &cursor_size))
+    cursor_height_ = cursor_size;
+
+  char validate_tests_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.max_validate_tests", validate_tests_prop, "4");
+  max_validate_tests_ = atoi(validate_tests_prop);
+
   crtc_ = drm_->GetCrtcForDisplay(display);
   if (!crtc_) {
     ALOGE("Failed to get crtc for display %d", display);
@@ -273,7 +311,21 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
   supported(__func__);
-  layers_.erase(layer);
+  auto it = layers_.find(layer);
+  if (it == layers_.end())
+    return HWC2::Error::BadLayer;
+  ClearValidatedComposition();
+  if (background_layer_ == &it->second)
+    background_layer_ = NULL;
+
+  // The layer's buffers won't be presented again, don't keep them imported
+  import_worker_.Cancel(&it->second);
+  buffer_cache_->EvictOwner(&it->second);
+  scanned_out_layers_.erase(std::remove(scanned_out_layers_.begin(),
+                                        scanned_out_layers_.end(),
+                                        &it->second),
+                            scanned_out_layers_.end());
+  layers_.erase(it);
   return HWC2::Error::None;
 }
 
@@ -549,11 +601,11 @@ void DrmHwcTwo::HwcDisplay::AddFenceToRetireFence(int fd) {
   if (fd < 0)
     return;
 
-  if (next_retire_fence_.get() >= 0) {
-    int old_fence = next_retire_fence_.get();
-    next_retire_fence_.Set(sync_merge("dc_retire", old_fence, fd));
+  if (retire_fence_.get() >= 0) {
+    int old_fence = retire_fence_.get();
+    retire_fence_.Set(sync_merge("dc_retire", old_fence, fd));
   } else {
-    next_retire_fence_.Set(dup(fd));
+    retire_fence_.Set(dup(fd));
   }
 }
 
@@ -563,25 +615,20 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   DrmCompositionDisplayLayersMap &map = layers_map.back();
 
   map.display = static_cast<int>(handle_);
-  map.geometry_changed = true;  // TODO: Fix this
 
   // order the layers by z-order
   bool use_client_layer = false;
   uint32_t client_z_order = UINT32_MAX;
   std::map<uint32_t, DrmHwcTwo::HwcLayer *> z_map;
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
-    HWC2::Composition comp_type;
-    if (test) {
-      comp_type = l.second.sf_type();
-      if (comp_type == HWC2::Composition::Device) {
-        if (!importer_->CanImportBuffer(l.second.buffer()))
-          comp_type = HWC2::Composition::Client;
-      }
-    } else
-      comp_type = l.second.validated_type();
-
-    switch (comp_type) {
+    if (&l.second == background_layer_ ||
+        (l.second.occluded() &&
+         l.second.validated_type() != HWC2::Composition::Client))
+      continue;
+    switch (l.second.validated_type()) {
       case HWC2::Composition::Device:
+      case HWC2::Composition::Cursor:
+      case HWC2::Composition::SolidColor:
         z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
         break;
       case HWC2::Composition::Client:
@@ -596,69 +643,253 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   if (use_client_layer)
     z_map.emplace(std::make_pair(client_z_order, &client_layer_));
 
-  if (z_map.empty())
+  if (z_map.empty() && !background_layer_)
     return HWC2::Error::BadLayer;
 
+  std::vector<HwcLayer *> z_layers;
+  for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map)
+    z_layers.push_back(l.second);
+  // Tracked along with the others, but it has no layer in the composition
+  if (background_layer_)
+    z_layers.push_back(background_layer_);
+
+  // SurfaceFlinger took the composition types ValidateDisplay tested, so the
+  // tested composition and its plan are still good
+  if (!test && validated_composition_ && validated_layers_ == z_layers)
+    return ApplyValidatedComposition();
+  ClearValidatedComposition();
+
   // now that they're ordered by z, add them to the composition
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
     DrmHwcLayer layer;
     l.second->PopulateDrmLayer(&layer);
-    int ret = layer.ImportBuffer(importer_.get());
+    layer.cursor = l.second->validated_type() == HWC2::Composition::Cursor;
+    int ret = layer.solid_color
+                  ? layer.ImportFillBuffer(fill_buffers_.get())
+                  : layer.ImportBuffer(buffer_cache_.get(), l.second);
     if (ret) {
       ALOGE("Failed to import layer, ret=%d", ret);
       return HWC2::Error::NoResources;
     }
+    l.second->UpdateBufferLayout(layer.buffer->width, layer.buffer->height,
+                                 layer.buffer->format,
+                                 layer.buffer->modifiers[0]);
     map.layers.emplace_back(std::move(layer));
   }
 
+  // The planes a validate may plan with, which a present has to match
+  std::vector<DrmPlane *> usable_planes = GetOverlayPlanes(true);
+  map.geometry_changed = GeometryChanged(z_layers, usable_planes);
+
+  // A new geometry may not fit on the planes, and only ValidateDisplay can
+  // send layers to the client instead
+  if (!test && !validated_ && map.geometry_changed)
+    return HWC2::Error::NotValidated;
+
   std::unique_ptr<DrmDisplayComposition> composition = compositor_
                                                            .CreateComposition();
   composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
+  if (background_layer_) {
+    DrmHwcLayer layer;
+    background_layer_->PopulateDrmLayerState(&layer);
+    composition->set_background_color(layer.BackgroundColor());
+  }
 
-  // TODO: Don't always assume geometry changed
-  int ret = composition->SetLayers(map.layers.data(), map.layers.size(), true);
+  int ret = composition->SetLayers(map.layers.data(), map.layers.size(),
+                                   map.geometry_changed);
   if (ret) {
     ALOGE("Failed to set layers in the composition ret=%d", ret);
     return HWC2::Error::BadLayer;
   }
 
+  // Only ValidateDisplay takes free shared planes. A present plans with the
+  // ones the display holds already, so it can't lose a plane to another
+  // display once SurfaceFlinger accepted the validated types.
   std::vector<DrmPlane *> primary_planes(primary_planes_);
-  std::vector<DrmPlane *> overlay_planes(overlay_planes_);
+  std::vector<DrmPlane *> overlay_planes = GetOverlayPlanes(test);
+  // Only the cursor stage places layers on cursor planes
+  overlay_planes.insert(overlay_planes.end(), cursor_planes_.begin(),
+                        cursor_planes_.end());
   ret = composition->Plan(&primary_planes, &overlay_planes);
   if (ret) {
     ALOGE("Failed to plan the composition ret=%d", ret);
     return HWC2::Error::BadConfig;
   }
 
-  // Disable the planes we're not using
+  // Hold on to the shared planes the composition uses
+  if (test) {
+    std::vector<DrmPlane *> shared_planes;
+    for (DrmCompositionPlane &plane : composition->composition_planes()) {
+      if (plane.plane() && resource_manager_->IsSharedPlane(plane.plane()))
+        shared_planes.push_back(plane.plane());
+    }
+    // A flip releasing them may be pending still, keep them first so they
+    // aren't released under us
+    compositor_.KeepSharedPlanes(shared_planes);
+    ret = resource_manager_->ClaimSharedPlanes(handle_, shared_planes);
+    if (ret) {
+      // ValidateDisplay moves more layers to the client, planning without
+      // the planes that were taken
+      ALOGV("Shared planes were taken by another display");
+      return HWC2::Error::NoResources;
+    }
+  }
+
+  // Disable the planes we're not using. Free shared planes are off already,
+  // and another display may have taken them by the time this commits.
   for (auto i = primary_planes.begin(); i != primary_planes.end();) {
     composition->AddPlaneDisable(*i);
     i = primary_planes.erase(i);
   }
   for (auto i = overlay_planes.begin(); i != overlay_planes.end();) {
-    composition->AddPlaneDisable(*i);
+    if (!resource_manager_->IsSharedPlane(*i) ||
+        resource_manager_->HoldsSharedPlane(handle_, *i))
+      composition->AddPlaneDisable(*i);
     i = overlay_planes.erase(i);
   }
 
   if (test) {
-    ret = compositor_.TestComposition(composition.get());
+    // The same geometry was committed before, it needn't be tested again
+    if (map.geometry_changed)
+      ret = compositor_.TestComposition(composition.get());
+    if (!ret) {
+      validated_composition_ = std::move(composition);
+      validated_layers_ = std::move(z_layers);
+      validated_overlay_planes_ = std::move(usable_planes);
+    }
   } else {
-    AddFenceToRetireFence(composition->take_out_fence());
-    ret = compositor_.ApplyComposition(std::move(composition));
+    return CommitComposition(std::move(composition), z_layers, usable_planes);
+  }
+  if (ret)
+    return HWC2::Error::BadParameter;
+  return HWC2::Error::None;
+}
+
+void DrmHwcTwo::HwcDisplay::SetValidatedTypes(
+    std::map<uint32_t, HwcLayer *> *z_map, size_t client_start,
+    size_t client_size) {
+  size_t i = 0;
+  for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : *z_map) {
+    HwcLayer *layer = l.second;
+    if (i >= client_start && i < client_start + client_size)
+      layer->set_validated_type(HWC2::Composition::Client);
+    else if (layer->sf_type() == HWC2::Composition::SolidColor)
+      layer->set_validated_type(HWC2::Composition::SolidColor);
+    else
+      layer->set_validated_type(HWC2::Composition::Device);
+    ++i;
+  }
+}
+
+void DrmHwcTwo::HwcDisplay::ClearValidatedComposition() {
+  validated_composition_.reset();
+  validated_layers_.clear();
+  validated_overlay_planes_.clear();
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::ApplyValidatedComposition() {
+  std::unique_ptr<DrmDisplayComposition> composition = std::move(
+      validated_composition_);
+  std::vector<HwcLayer *> layers;
+  layers.swap(validated_layers_);
+  std::vector<DrmPlane *> overlay_planes;
+  overlay_planes.swap(validated_overlay_planes_);
+
+  // The client target is only set once validation is done, swap in the
+  // current one. Its size and format don't change, so the test still holds.
+  for (size_t i = 0; i < layers.size(); ++i) {
+    if (layers[i] != &client_layer_)
+      continue;
+    DrmHwcLayer layer;
+    client_layer_.PopulateDrmLayer(&layer);
+    int ret = layer.ImportBuffer(buffer_cache_.get(), &client_layer_);
+    if (ret) {
+      ALOGE("Failed to import client target, ret=%d", ret);
+      return HWC2::Error::NoResources;
+    }
+    composition->layers()[i] = std::move(layer);
   }
+
+  return CommitComposition(std::move(composition), layers, overlay_planes);
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::CommitComposition(
+    std::unique_ptr<DrmDisplayComposition> composition,
+    const std::vector<HwcLayer *> &z_layers,
+    const std::vector<DrmPlane *> &overlay_planes) {
+  int out_fence = -1;
+  int ret = compositor_.ApplyComposition(std::move(composition), &out_fence);
   if (ret) {
-    if (!test)
-      ALOGE("Failed to apply the frame composition ret=%d", ret);
+    ALOGE("Failed to apply the frame composition ret=%d", ret);
+    // The compositor cleared the display, the next frame can't build on it
+    committed_generation_ = 0;
     return HWC2::Error::BadParameter;
   }
+  CommitGeometry(z_layers, overlay_planes);
+  if (out_fence >= 0) {
+    AddFenceToRetireFence(out_fence);
+    close(out_fence);
+  }
   return HWC2::Error::None;
 }
 
+std::vector<DrmPlane *> DrmHwcTwo::HwcDisplay::GetOverlayPlanes(
+    bool free_shared) {
+  std::vector<DrmPlane *> planes(overlay_planes_);
+  if (use_overlay_planes_) {
+    for (DrmPlane *plane : resource_manager_->GetSharedPlanes(handle_)) {
+      if (free_shared || resource_manager_->HoldsSharedPlane(handle_, plane))
+        planes.push_back(plane);
+    }
+  }
+  return planes;
+}
+
+bool DrmHwcTwo::HwcDisplay::GeometryChanged(
+    const std::vector<HwcLayer *> &z_layers,
+    const std::vector<DrmPlane *> &overlay_planes) {
+  // Shared planes coming and going change what fits on the planes
+  if (overlay_planes != overlay_planes_used_) {
+    // Tests passed while another display had the planes may not pass now
+    planner_->ClearPlanCache();
+    return true;
+  }
+  // Layers moving between planes and client composition, or being added or
+  // removed, change the plane assignment
+  if (geometry_generation_ != committed_generation_ ||
+      z_layers != composited_layers_)
+    return true;
+  for (HwcLayer *layer : z_layers) {
+    if (layer->geometry_changed())
+      return true;
+  }
+  return false;
+}
+
+void DrmHwcTwo::HwcDisplay::CommitGeometry(
+    const std::vector<HwcLayer *> &z_layers,
+    const std::vector<DrmPlane *> &overlay_planes) {
+  // Not before the frame is committed, so a frame that fails or isn't
+  // presented after all leaves the changes to the next one
+  for (HwcLayer *layer : z_layers)
+    layer->clear_geometry_changed();
+  composited_layers_ = z_layers;
+  overlay_planes_used_ = overlay_planes;
+  committed_generation_ = geometry_generation_;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   supported(__func__);
   HWC2::Error ret;
 
+  // SurfaceFlinger skips validation when it thinks nothing but buffers
+  // changed, make sure
+  if (!validated_ && !CanSkipValidate())
+    return HWC2::Error::NotValidated;
+
   ret = CreateComposition(false);
+  validated_ = false;
+  ClearValidatedComposition();
   if (ret == HWC2::Error::BadLayer) {
     // Can we really have no client or device layers?
     *retire_fence = -1;
@@ -667,15 +898,118 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   if (ret != HWC2::Error::None)
     return ret;
 
-  // The retire fence returned here is for the last frame, so return it and
-  // promote the next retire fence
+  // The frame was committed without waiting for its flip, its out fence is
+  // the present fence of this very frame. The commit did wait for the flip
+  // of the frame before though, the kernel takes one nonblocking commit per
+  // crtc at a time. So presenting ahead of the display still blocks for up
+  // to a refresh.
+  SetReleaseFences(retire_fence_.get());
   *retire_fence = retire_fence_.Release();
-  retire_fence_ = std::move(next_retire_fence_);
 
   ++frame_no_;
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::SetReleaseFences(int present_fence) {
+  // The buffers the last frame scanned out are done with once this frame is
+  // on screen, for layers that got a new buffer or left the planes alike
+  std::vector<HwcLayer *> scanned_out;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    HwcLayer *layer = &l.second;
+    bool on_plane = layer->validated_type() == HWC2::Composition::Device ||
+                    layer->validated_type() == HWC2::Composition::Cursor;
+    if (on_plane)
+      scanned_out.push_back(layer);
+    if (present_fence >= 0 &&
+        (on_plane || std::find(scanned_out_layers_.begin(),
+                               scanned_out_layers_.end(),
+                               layer) != scanned_out_layers_.end()))
+      layer->set_release_fence(dup(present_fence));
+  }
+  scanned_out_layers_.swap(scanned_out);
+}
+
+bool DrmHwcTwo::HwcDisplay::CanUseCursorPlane(HwcLayer *layer) {
+  if (cursor_planes_.empty() ||
+      layer->sf_type() != HWC2::Composition::Cursor ||
+      !importer_->CanImportBuffer(layer->buffer()))
+    return false;
+
+  DrmHwcLayer drm_layer;
+  layer->PopulateDrmLayerState(&drm_layer);
+  drm_layer.cursor = true;
+  if (drm_layer.ImportBuffer(buffer_cache_.get(), layer))
+    return false;
+
+  // Cursor planes are only so big, ValidatePlane checks they needn't scale
+  hwc_rect_t &frame = drm_layer.display_frame;
+  uint32_t width = frame.right - frame.left;
+  uint32_t height = frame.bottom - frame.top;
+  if (width > cursor_width_ || height > cursor_height_)
+    return false;
+
+  return std::any_of(cursor_planes_.begin(), cursor_planes_.end(),
+                     [&](DrmPlane *plane) {
+                       return !Planner::PlanStage::ValidatePlane(plane,
+                                                                 &drm_layer);
+                     });
+}
+
+HWC2::Error DrmHwcTwo::HwcDisplay::SetCursorPosition(hwc2_layer_t layer,
+                                                     int32_t x, int32_t y) {
+  auto it = layers_.find(layer);
+  if (it == layers_.end())
+    return HWC2::Error::BadLayer;
+
+  HWC2::Error ret = it->second.SetCursorPosition(x, y);
+  if (ret != HWC2::Error::None ||
+      it->second.validated_type() != HWC2::Composition::Cursor)
+    return ret;
+
+  // Move the cursor plane right away rather than waiting for the next frame
+  int err = compositor_.MoveCursor(x, y);
+  if (err)
+    ALOGE("Failed to move the cursor %d", err);
+  return HWC2::Error::None;
+}
+
+bool DrmHwcTwo::HwcDisplay::CanUseBackgroundColor(HwcLayer *layer) {
+  if (!crtc_->background_color_property().id() ||
+      layer->sf_type() != HWC2::Composition::SolidColor)
+    return false;
+
+  // The background shows wherever there's no plane, so the layer has to cover
+  // the whole display
+  uint32_t width, height;
+  int ret;
+  std::tie(width, height, ret) = compositor_.GetActiveModeResolution();
+  if (ret)
+    return false;
+
+  DrmHwcLayer drm_layer;
+  layer->PopulateDrmLayerState(&drm_layer);
+  hwc_rect_t &frame = drm_layer.display_frame;
+  return frame.left <= 0 && frame.top <= 0 &&
+         frame.right >= static_cast<int>(width) &&
+         frame.bottom >= static_cast<int>(height);
+}
+
+bool DrmHwcTwo::HwcDisplay::CanSkipValidate() {
+  // The client target is rendered according to the validated types, there's
+  // none to present for a frame SurfaceFlinger hasn't validated
+  if (layers_.empty())
+    return false;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    HwcLayer &layer = l.second;
+    if (layer.sf_type() != layer.validated_type() ||
+        layer.validated_type() == HWC2::Composition::Client ||
+        layer.validated_type() == HWC2::Composition::Sideband ||
+        layer.geometry_changed())
+      return false;
+  }
+  return true;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
   supported(__func__);
   auto mode = std::find_if(connector_->modes().begin(),
@@ -700,6 +1034,12 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
 
   connector_->set_active_mode(*mode);
 
+  // The validated composition and cached plans were tested against the old
+  // mode
+  ClearValidatedComposition();
+  planner_->ClearPlanCache();
+  ++geometry_generation_;
+
   // Setup the client layer's dimensions
   hwc_rect_t display_frame = {.left = 0,
                               .top = 0,
@@ -718,13 +1058,15 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
 HWC2::Error DrmHwcTwo::HwcDisplay::SetClientTarget(buffer_handle_t target,
                                                    int32_t acquire_fence,
                                                    int32_t dataspace,
-                                                   hwc_region_t /*damage*/) {
+                                                   hwc_region_t damage) {
   supported(__func__);
   UniqueFd uf(acquire_fence);
 
   client_layer_.set_buffer(target);
   client_layer_.set_acquire_fence(uf.get());
   client_layer_.SetLayerDataspace(dataspace);
+  client_layer_.SetLayerSurfaceDamage(damage);
+  PrefetchBuffer(target, &client_layer_);
   return HWC2::Error::None;
 }
 
@@ -745,6 +1087,38 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetColorTransform(const float *matrix,
   return unsupported(__func__, matrix, hint);
 }
 
+HWC2::Error DrmHwcTwo::HwcDisplay::SetLayerBuffer(hwc2_layer_t layer,
+                                                  buffer_handle_t buffer,
+                                                  int32_t acquire_fence) {
+  auto it = layers_.find(layer);
+  if (it == layers_.end()) {
+    UniqueFd uf(acquire_fence);
+    return HWC2::Error::BadLayer;
+  }
+
+  HwcLayer &hwc_layer = it->second;
+  HWC2::Error ret = hwc_layer.SetLayerBuffer(buffer, acquire_fence);
+  if (ret != HWC2::Error::None)
+    return ret;
+
+  // Client, sideband and solid color layers don't keep the buffer
+  if (hwc_layer.buffer() == buffer)
+    PrefetchBuffer(buffer, &hwc_layer);
+  return HWC2::Error::None;
+}
+
+void DrmHwcTwo::HwcDisplay::PrefetchBuffer(buffer_handle_t buffer,
+                                           const HwcLayer *owner) {
+  // Import now rather than at validate time, the import overlaps with the
+  // rest of SurfaceFlinger's frame and CreateComposition finds it cached
+  if (!buffer || !importer_->CanImportBuffer(buffer))
+    return;
+
+  int ret = import_worker_.Queue(buffer, owner);
+  if (ret)
+    ALOGE("Failed to queue buffer import %d", ret);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::SetOutputBuffer(buffer_handle_t buffer,
                                                    int32_t release_fence) {
   supported(__func__);
@@ -777,6 +1151,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
     ALOGE("Failed to apply the dpms composition ret=%d", ret);
     return HWC2::Error::BadParameter;
   }
+  // Turning off gave up the shared planes, the next frame plans afresh
+  ClearValidatedComposition();
+  planner_->ClearPlanCache();
+  ++geometry_generation_;
   return HWC2::Error::None;
 }
 
@@ -791,47 +1169,110 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
   supported(__func__);
   *num_types = 0;
   *num_requests = 0;
-  size_t avail_planes = primary_planes_.size() + overlay_planes_.size();
-  bool comp_failed = false;
-
-  HWC2::Error ret;
 
-  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
-    l.second.set_validated_type(HWC2::Composition::Invalid);
-
-  ret = CreateComposition(true);
-  if (ret != HWC2::Error::None)
-    comp_failed = true;
-
-  std::map<uint32_t, DrmHwcTwo::HwcLayer *, std::greater<int>> z_map;
+  std::map<uint32_t, DrmHwcTwo::HwcLayer *> z_map;
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
-    if (l.second.sf_type() == HWC2::Composition::Device)
-      z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
+    HwcLayer &layer = l.second;
+    // Hidden layers need neither a plane nor the GPU, but SurfaceFlinger
+    // still expects their type to be taken
+    bool plane_type = layer.sf_type() == HWC2::Composition::Device ||
+                      layer.sf_type() == HWC2::Composition::SolidColor;
+    if (layer.occluded() && plane_type) {
+      layer.set_validated_type(layer.sf_type());
+      continue;
+    }
+    layer.set_validated_type(HWC2::Composition::Client);
+    z_map.emplace(std::make_pair(layer.z_order(), &layer));
+  }
+
+  // SurfaceFlinger's cursor sits at the top of the stack, as does the cursor
+  // plane. Take it out of the running for the other planes.
+  if (!z_map.empty() && CanUseCursorPlane(z_map.rbegin()->second)) {
+    z_map.rbegin()->second->set_validated_type(HWC2::Composition::Cursor);
+    z_map.erase(std::prev(z_map.end()));
   }
 
-  /*
-   * If more layers then planes, save one plane
-   * for client composited layers
-   */
-  if (avail_planes < layers_.size())
-    avail_planes--;
+  // A full screen SolidColor layer at the bottom needs no plane at all
+  background_layer_ = NULL;
+  if (!z_map.empty() && CanUseBackgroundColor(z_map.begin()->second)) {
+    background_layer_ = z_map.begin()->second;
+    background_layer_->set_validated_type(HWC2::Composition::SolidColor);
+    z_map.erase(z_map.begin());
+  }
 
+  // Only layers SurfaceFlinger wants on a plane and that we can import are
+  // candidates, everything else has to go to the client target. SolidColor
+  // layers only need a fill buffer, which the pool usually has already.
+  std::vector<DrmHwcLayer> drm_layers(z_map.size());
+  std::vector<DrmHwcLayer *> candidates;
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
-    if (comp_failed || !avail_planes--)
+    DrmHwcLayer *drm_layer = &drm_layers[candidates.size()];
+    HwcLayer *layer = l.second;
+    bool solid_color = layer->sf_type() == HWC2::Composition::SolidColor;
+    if (!solid_color && (layer->sf_type() != HWC2::Composition::Device ||
+                         !importer_->CanImportBuffer(layer->buffer()))) {
+      candidates.push_back(NULL);
+      continue;
+    }
+    layer->PopulateDrmLayerState(drm_layer);
+    int ret = solid_color
+                  ? drm_layer->ImportFillBuffer(fill_buffers_.get())
+                  : drm_layer->ImportBuffer(buffer_cache_.get(), layer);
+    if (ret)
+      drm_layer = NULL;
+    candidates.push_back(drm_layer);
+  }
+
+  size_t client_start, client_size;
+  std::vector<DrmPlane *> overlay_planes = GetOverlayPlanes(true);
+  std::tie(client_start, client_size) = planner_
+                                            ->GetClientRange(candidates, crtc_,
+                                                             &primary_planes_,
+                                                             &overlay_planes);
+
+  // A rejected test usually comes down to one layer the kernel doesn't like.
+  // Rather than sending the whole stack to the GPU, grow the client range a
+  // layer at a time, taking the cheaper neighbour, for as long as the budget
+  // of test commits allows. The accepted composition is kept for
+  // PresentDisplay, which reuses it if SurfaceFlinger takes these types.
+  size_t num_layers = z_map.size();
+  int tests_left = max_validate_tests_;
+  bool accepted = false;
+  while (client_size < num_layers && tests_left-- > 0) {
+    SetValidatedTypes(&z_map, client_start, client_size);
+    ClearValidatedComposition();
+    if (CreateComposition(true) == HWC2::Error::None) {
+      accepted = true;
       break;
-    if (importer_->CanImportBuffer(l.second->buffer()))
-      l.second->set_validated_type(HWC2::Composition::Device);
+    }
+
+    if (!client_size) {
+      // Nothing to grow from yet, start with the cheapest layer
+      client_start = std::min_element(candidates.begin(), candidates.end(),
+                                      [](DrmHwcLayer *a, DrmHwcLayer *b) {
+                                        return Planner::ClientCost(a) <
+                                               Planner::ClientCost(b);
+                                      }) -
+                     candidates.begin();
+    } else if (client_start + client_size == num_layers ||
+               (client_start > 0 &&
+                Planner::ClientCost(candidates[client_start - 1]) <=
+                    Planner::ClientCost(
+                        candidates[client_start + client_size]))) {
+      --client_start;
+    }
+    ++client_size;
+  }
+  if (!accepted) {
+    ClearValidatedComposition();
+    SetValidatedTypes(&z_map, 0, num_layers);
   }
 
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
-    DrmHwcTwo::HwcLayer &layer = l.second;
-    // We can only handle layers of Device type, send everything else to SF
-    if (layer.sf_type() != HWC2::Composition::Device ||
-        layer.validated_type() != HWC2::Composition::Device) {
-      layer.set_validated_type(HWC2::Composition::Client);
+    if (l.second.type_changed())
       ++*num_types;
-    }
   }
+  validated_ = true;
   return *num_types ? HWC2::Error::HasChanges : HWC2::Error::None;
 }
 
@@ -844,6 +1285,8 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetCursorPosition(int32_t x, int32_t y) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBlendMode(int32_t mode) {
   supported(__func__);
+  if (blending_ != static_cast<HWC2::BlendMode>(mode))
+    geometry_changed_ = true;
   blending_ = static_cast<HWC2::BlendMode>(mode);
   return HWC2::Error::None;
 }
@@ -865,11 +1308,14 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerColor(hwc_color_t color) {
-  // TODO: Punt to client composition here?
-  return unsupported(__func__, color);
+  supported(__func__);
+  color_ = color;
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerCompositionType(int32_t type) {
+  if (sf_type_ != static_cast<HWC2::Composition>(type))
+    geometry_changed_ = true;
   sf_type_ = static_cast<HWC2::Composition>(type);
   return HWC2::Error::None;
 }
@@ -882,12 +1328,23 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerDataspace(int32_t dataspace) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerDisplayFrame(hwc_rect_t frame) {
   supported(__func__);
+  // The cursor moving around is a position update MoveCursor takes care of,
+  // only a new size changes the geometry
+  bool moved_only = sf_type_ == HWC2::Composition::Cursor &&
+                    frame.right - frame.left ==
+                        display_frame_.right - display_frame_.left &&
+                    frame.bottom - frame.top ==
+                        display_frame_.bottom - display_frame_.top;
+  if (!moved_only && memcmp(&display_frame_, &frame, sizeof(frame)))
+    geometry_changed_ = true;
   display_frame_ = frame;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerPlaneAlpha(float alpha) {
   supported(__func__);
+  if (alpha_ != alpha)
+    geometry_changed_ = true;
   alpha_ = alpha;
   return HWC2::Error::None;
 }
@@ -901,38 +1358,87 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSidebandStream(
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
   supported(__func__);
+  if (memcmp(&source_crop_, &crop, sizeof(crop)))
+    geometry_changed_ = true;
   source_crop_ = crop;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSurfaceDamage(hwc_region_t damage) {
   supported(__func__);
-  // TODO: We don't use surface damage, marking as unsupported
-  unsupported(__func__, damage);
+  // No rects means the whole buffer, a single empty rect means nothing
+  // changed, both pass through as is
+  damage_.assign(damage.rects, damage.rects + damage.numRects);
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerTransform(int32_t transform) {
   supported(__func__);
+  if (transform_ != static_cast<HWC2::Transform>(transform))
+    geometry_changed_ = true;
   transform_ = static_cast<HWC2::Transform>(transform);
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerVisibleRegion(hwc_region_t visible) {
   supported(__func__);
-  // TODO: We don't use this information, marking as unsupported
-  unsupported(__func__, visible);
+  std::vector<hwc_rect_t> rects(visible.rects,
+                                visible.rects + visible.numRects);
+  hwc_rect_t bounds = {0, 0, 0, 0};
+  for (const hwc_rect_t &rect : rects) {
+    if (rect.left >= rect.right || rect.top >= rect.bottom)
+      continue;
+    if (bounds.left >= bounds.right) {
+      bounds = rect;
+      continue;
+    }
+    bounds.left = std::min(bounds.left, rect.left);
+    bounds.top = std::min(bounds.top, rect.top);
+    bounds.right = std::max(bounds.right, rect.right);
+    bounds.bottom = std::max(bounds.bottom, rect.bottom);
+  }
+
+  // Only the bounds decide the layer's plane and how much of it is scanned
+  // out
+  if (!visible_region_set_ ||
+      memcmp(&visible_bounds_, &bounds, sizeof(bounds)))
+    geometry_changed_ = true;
+  visible_bounds_ = bounds;
+  visible_region_set_ = true;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerZOrder(uint32_t order) {
   supported(__func__);
+  if (z_order_ != order)
+    geometry_changed_ = true;
   z_order_ = order;
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcLayer::UpdateBufferLayout(uint32_t width, uint32_t height,
+                                             uint32_t format,
+                                             uint64_t modifier) {
+  // A buffer of another size or format may not fit the plane it was on
+  auto layout = std::make_tuple(width, height, format, modifier);
+  if (buffer_layout_ != layout)
+    geometry_changed_ = true;
+  buffer_layout_ = layout;
+}
+
 void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   supported(__func__);
+  PopulateDrmLayerState(layer);
+
+  OutputFd release_fence = release_fence_output();
+
+  // ValidateDisplay may test several compositions for a frame, each needs a
+  // fence of its own
+  layer->acquire_fence = dup(acquire_fence_.get());
+  layer->release_fence = std::move(release_fence);
+}
+
+void DrmHwcTwo::HwcLayer::PopulateDrmLayerState(DrmHwcLayer *layer) {
   switch (blending_) {
     case HWC2::BlendMode::None:
       layer->blending = DrmHwcBlending::kNone;
@@ -949,15 +1455,22 @@ void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
       break;
   }
 
-  OutputFd release_fence = release_fence_output();
-
   layer->sf_handle = buffer_;
-  layer->acquire_fence = acquire_fence_.Release();
-  layer->release_fence = std::move(release_fence);
+  layer->damage = damage_;
+  layer->solid_color = sf_type_ == HWC2::Composition::SolidColor;
+  layer->color = static_cast<uint32_t>(color_.a) << 24 |
+                 static_cast<uint32_t>(color_.r) << 16 |
+                 static_cast<uint32_t>(color_.g) << 8 | color_.b;
   layer->SetDisplayFrame(display_frame_);
   layer->alpha = static_cast<uint16_t>(65535.0f * alpha_ + 0.5f);
   layer->SetSourceCrop(source_crop_);
   layer->SetTransform(static_cast<int32_t>(transform_));
+
+  // What's left of an opaque layer is covered by the layers above, there's
+  // no point in scanning it out
+  if (visible_region_set_ && !occluded() &&
+      blending_ == HWC2::BlendMode::None && alpha_ == 1.0f)
+    layer->CropToFrame(visible_bounds_);
 }
 
 void DrmHwcTwo::HandleDisplayHotplug(hwc2_display_t displayid, int state) {
@@ -1015,9 +1528,20 @@ int DrmHwcTwo::HookDevClose(hw_device_t * /*dev*/) {
 // static
 void DrmHwcTwo::HookDevGetCapabilities(hwc2_device_t * /*dev*/,
                                        uint32_t *out_count,
-                                       int32_t * /*out_capabilities*/) {
+                                       int32_t *out_capabilities) {
   supported(__func__);
-  *out_count = 0;
+  // PresentDisplay falls back to NotValidated when a frame needs validating
+  static const HWC2::Capability kCapabilities[] = {
+      HWC2::Capability::SkipValidate,
+  };
+  uint32_t num_capabilities = sizeof(kCapabilities) / sizeof(kCapabilities[0]);
+  if (!out_capabilities) {
+    *out_count = num_capabilities;
+    return;
+  }
+  *out_count = std::min(*out_count, num_capabilities);
+  for (uint32_t i = 0; i < *out_count; ++i)
+    out_capabilities[i] = static_cast<int32_t>(kCapabilities[i]);
 }
 
 // static
@@ -1159,16 +1683,18 @@ hwc2_function_pointer_t DrmHwcTwo::HookDevGetFunction(
     // Layer functions
     case HWC2::FunctionDescriptor::SetCursorPosition:
       return ToHook<HWC2_PFN_SET_CURSOR_POSITION>(
-          LayerHook<decltype(&HwcLayer::SetCursorPosition),
-                    &HwcLayer::SetCursorPosition, int32_t, int32_t>);
+          DisplayHook<decltype(&HwcDisplay::SetCursorPosition),
+                      &HwcDisplay::SetCursorPosition, hwc2_layer_t, int32_t,
+                      int32_t>);
     case HWC2::FunctionDescriptor::SetLayerBlendMode:
       return ToHook<HWC2_PFN_SET_LAYER_BLEND_MODE>(
           LayerHook<decltype(&HwcLayer::SetLayerBlendMode),
                     &HwcLayer::SetLayerBlendMode, int32_t>);
     case HWC2::FunctionDescriptor::SetLayerBuffer:
       return ToHook<HWC2_PFN_SET_LAYER_BUFFER>(
-          LayerHook<decltype(&HwcLayer::SetLayerBuffer),
-                    &HwcLayer::SetLayerBuffer, buffer_handle_t, int32_t>);
+          DisplayHook<decltype(&HwcDisplay::SetLayerBuffer),
+                      &HwcDisplay::SetLayerBuffer, hwc2_layer_t,
+                      buffer_handle_t, int32_t>);
     case HWC2::FunctionDescriptor::SetLayerColor:
       return ToHook<HWC2_PFN_SET_LAYER_COLOR>(
           LayerHook<decltype(&HwcLayer::SetLayerColor),
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_BUFFER_CACHE_H_
+#define ANDROID_DRM_BUFFER_CACHE_H_
+
+#include "drmhwcomposer.h"
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include <hardware/hardware.h>
+
+namespace android {
+
+class DrmBufferReaper;
+class Importer;
+
+// Keeps imported buffers alive across frames so that a buffer cycling through
+// a BufferQueue is only imported into KMS and the GraphicBufferMapper once.
+// Buffers are identified by the memory behind the handle (st_dev/st_ino of the
+// first fd), not by the handle itself, since SurfaceFlinger hands out new
+// handles for the same buffer. Entries are evicted least-recently-used or when
+// their owner (the layer that last presented them) goes away.
+class DrmBufferCache {
+ public:
+  // Identifies the memory behind a handle, the same for every handle
+  // SurfaceFlinger creates for a buffer
+  typedef std::pair<dev_t, ino_t> BufferId;
+
+  static int GetBufferId(buffer_handle_t handle, BufferId *id);
+
+  DrmBufferCache(Importer *importer, DrmBufferReaper *reaper, size_t max_size);
+  DrmBufferCache(const DrmBufferCache &) = delete;
+  DrmBufferCache &operator=(const DrmBufferCache &) = delete;
+  ~DrmBufferCache();
+
+  int ImportBuffer(buffer_handle_t handle, const void *owner,
+                   std::shared_ptr<hwc_drm_bo_t> *bo,
+                   DrmHwcNativeHandle *native_handle);
+  void EvictOwner(const void *owner);
+  void Clear();
+
+  size_t size();
+
+ private:
+  typedef BufferId Key;
+
+  struct Entry {
+    std::shared_ptr<hwc_drm_bo_t> bo;
+    DrmHwcNativeHandle handle;
+    const void *owner;
+    std::list<Key>::iterator lru;
+  };
+
+  Importer *importer_;
+  DrmBufferReaper *reaper_;
+  size_t max_size_;
+
+  std::mutex lock_;
+  std::list<Key> lru_;
+  std::map<Key, Entry> entries_;
+  // Buffers being imported outside the lock
+  std::set<Key> pending_;
+  std::condition_variable pending_cond_;
+};
+}  // namespace android
+
+#endif
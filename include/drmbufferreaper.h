@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_BUFFER_REAPER_H_
+#define ANDROID_DRM_BUFFER_REAPER_H_
+
+#include "drmhwcgralloc.h"
+#include "worker.h"
+
+#include <atomic>
+#include <functional>
+
+namespace android {
+
+class Importer;
+
+// Releases retired framebuffers on its own thread. Removing a framebuffer may
+// block until the hardware is done scanning it out, which must not happen on
+// the present path. A buffer is only retired once the last reference to it
+// goes, and the compositions on screen hold one. The compositor drops the
+// composition a frame replaced only once that frame's flip is done, so
+// buffers are released right away once they get here.
+class DrmBufferReaper : public Worker {
+ public:
+  DrmBufferReaper();
+  ~DrmBufferReaper() override;
+
+  int Init();
+
+  // Takes ownership of bo and releases it through importer. Doesn't block,
+  // may be called from any thread.
+  void Queue(Importer *importer, hwc_drm_bo_t *bo);
+  // Runs release on the reaper thread, for buffers no importer made
+  void Queue(std::function<void()> release);
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Node {
+    std::function<void()> release;
+    Node *next;
+  };
+
+  void ReleaseQueued();
+
+  std::atomic<Node *> head_;
+};
+}  // namespace android
+
+#endif
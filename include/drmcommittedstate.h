@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ANDROID_DRM_COMMITTED_STATE_H_
+#define ANDROID_DRM_COMMITTED_STATE_H_
+
+#include <stdint.h>
+#include <map>
+#include <utility>
+
+namespace android {
+
+// The plane and crtc property values as of the last successful commit, so
+// that commits only carry the properties that changed since. Whenever the
+// kernel state may have moved on without us, the state has to be cleared and
+// the next commit sends everything again. Not thread safe.
+class DrmCommittedState {
+ public:
+  // Property values by (object id, property id)
+  typedef std::map<std::pair<uint32_t, uint32_t>, uint64_t> PropertyMap;
+
+  // Returns whether value has to be committed for the property, and records
+  // it in pending if so. With a NULL pending it always has to.
+  bool Changed(uint32_t object_id, uint32_t property_id, uint64_t value,
+               PropertyMap *pending) const;
+  // Takes on the values of a commit that succeeded
+  void Commit(const PropertyMap &pending);
+  void Clear();
+
+  bool empty() const {
+    return values_.empty();
+  }
+
+ private:
+  PropertyMap values_;
+};
+}  // namespace android
+
+#endif
@@ -135,10 +135,26 @@ class DrmDisplayComposition {
     return geometry_changed_;
   }
 
+  // Whether the composition already passed a TEST_ONLY commit
+  bool tested() const {
+    return tested_;
+  }
+  void set_tested(bool tested) {
+    tested_ = tested;
+  }
+
   uint64_t frame_no() const {
     return frame_no_;
   }
 
+  // DRM_ARGB64 color of the CRTC below all planes
+  uint64_t background_color() const {
+    return background_color_;
+  }
+  void set_background_color(uint64_t color) {
+    background_color_ = color;
+  }
+
   DrmCompositionType type() const {
     return type_;
   }
@@ -163,6 +179,11 @@ class DrmDisplayComposition {
     return planner_;
   }
 
+  // The id the planner cached the plan under, 0 if not planned
+  uint64_t plan_id() const {
+    return plan_id_;
+  }
+
   int take_out_fence() {
     return out_fence_.Release();
   }
@@ -188,10 +209,13 @@ class DrmDisplayComposition {
   UniqueFd out_fence_ = -1;
 
   bool geometry_changed_;
+  bool tested_ = false;
   std::vector<DrmHwcLayer> layers_;
   std::vector<DrmCompositionPlane> composition_planes_;
 
   uint64_t frame_no_ = 0;
+  uint64_t plan_id_ = 0;
+  uint64_t background_color_ = kDefaultBackgroundColor;
 };
 }  // namespace android
 
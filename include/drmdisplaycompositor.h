@@ -17,6 +17,7 @@
 #ifndef ANDROID_DRM_DISPLAY_COMPOSITOR_H_
 #define ANDROID_DRM_DISPLAY_COMPOSITOR_H_
 
+#include "drmcommittedstate.h"
 #include "drmdisplaycomposition.h"
 #include "drmframebuffer.h"
 #include "drmhwcomposer.h"
@@ -24,9 +25,12 @@
 #include "vsyncworker.h"
 
 #include <pthread.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <tuple>
+#include <vector>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -41,6 +45,8 @@
 
 namespace android {
 
+struct CompositorFlipState;
+
 class DrmDisplayCompositor {
  public:
   DrmDisplayCompositor();
@@ -50,13 +56,22 @@ class DrmDisplayCompositor {
 
   std::unique_ptr<DrmDisplayComposition> CreateComposition() const;
   std::unique_ptr<DrmDisplayComposition> CreateInitializedComposition() const;
-  int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
+  // Applies composition right away. The out fence of a frame is returned in
+  // out_fence, if given.
+  int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition,
+                       int *out_fence = NULL);
   int TestComposition(DrmDisplayComposition *composition);
+  // Moves the cursor plane of the active composition to (x, y) without going
+  // through a full frame commit. While the last move is in flight, this one is
+  // deferred to the next frame or vblank rather than waiting for it.
+  int MoveCursor(int x, int y);
   int Composite();
   void Dump(std::ostringstream *out) const;
   void Vsync(int display, int64_t timestamp);
   void ClearDisplay();
-
+  // Cancels the release of shared planes still waiting on a flip, the next
+  // frame uses them again
+  void KeepSharedPlanes(const std::vector<DrmPlane *> &planes);
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
  private:
@@ -73,6 +88,9 @@ class DrmDisplayCompositor {
   // kAcquireWaitTries times, logging a warning in between.
   static const int kAcquireWaitTries = 5;
   static const int kAcquireWaitTimeoutMs = 100;
+  // A page flip event that hasn't arrived after kFlipTimeoutMs is assumed
+  // lost
+  static const int kFlipTimeoutMs = 1000;
 
   int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
                   DrmConnector *writeback_conn = NULL,
@@ -82,9 +100,46 @@ class DrmDisplayCompositor {
                            DrmHwcBuffer *writeback_buffer);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
-
-  void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
-                  int status, bool writeback = false);
+  // Disables the shared planes the display holds and releases them
+  int DisableSharedPlanes();
+
+  // Commits pset without waiting for the flip, requesting a page flip event
+  // to track it. The shared planes the commit disables are released once the
+  // flip is done.
+  int CommitNonblocking(DrmDevice *drm, drmModeAtomicReqPtr pset,
+                        uint32_t flags,
+                        const std::vector<DrmPlane *> &disabled_shared_planes);
+  // Waits for the page flip of the last nonblocking commit. The kernel
+  // rejects nonblocking commits with -EBUSY while one is still in flight.
+  void WaitForFlip();
+  bool FlipPending();
+  // Frees composition once the flip of the last commit, which took it off
+  // the screen, is done
+  void RetireComposition(std::unique_ptr<DrmDisplayComposition> composition);
+
+  // The layer on the cursor plane of composition, if any
+  DrmHwcLayer *GetCursorLayer(DrmDisplayComposition *composition,
+                              DrmCompositionPlane **cursor_plane);
+  // Moves layer to the pending cursor position
+  void MoveCursorLayer(DrmHwcLayer *layer);
+  // Commits the pending cursor position, unless a flip is in flight. Must be
+  // called with lock_ held.
+  int CommitCursor();
+
+  typedef DrmCommittedState::PropertyMap PropertyState;
+
+  // Adds the property to pset unless committed_state_ already has value for
+  // it, and records it in pending. With a NULL pending the property is always
+  // added. Must be called with committed_state_lock_ held.
+  int AddProperty(drmModeAtomicReqPtr pset, uint32_t object_id,
+                  const DrmProperty &property, uint64_t value,
+                  PropertyState *pending);
+  // Shared planes may have been committed by another display since we last
+  // used them, so their properties are always sent
+  PropertyState *GetPendingState(DrmPlane *plane, PropertyState *pending);
+
+  int ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
+                 int status, bool writeback = false, int *out_fence = NULL);
   int FlattenActiveComposition();
   int FlattenSerial(DrmConnector *writeback_conn);
   int FlattenConcurrent(DrmConnector *writeback_conn);
@@ -93,8 +148,11 @@ class DrmDisplayCompositor {
                        DrmHwcLayer *writeback_layer);
 
   bool CountdownExpired() const;
+  bool CanUsePlane(DrmPlane *plane);
 
   std::tuple<int, uint32_t> CreateModeBlob(const DrmMode &mode);
+  int GetDamageBlob(DrmPlane *plane, const std::vector<hwc_rect_t> &damage,
+                    uint32_t *blob_id);
 
   ResourceManager *resource_manager_;
   int display_;
@@ -119,8 +177,30 @@ class DrmDisplayCompositor {
   mutable uint64_t dump_last_timestamp_ns_;
   VSyncWorker vsync_worker_;
   int64_t flatten_countdown_;
+  // The last cursor position MoveCursor got, pending until it's committed
+  struct {
+    int x = 0;
+    int y = 0;
+    bool pending = false;
+  } cursor_;
   std::unique_ptr<Planner> planner_;
   int writeback_fence_;
+
+  // The FB_DAMAGE_CLIPS blob last used on each plane, reused for as long as
+  // the damage stays the same
+  struct DamageBlob {
+    std::vector<hwc_rect_t> damage;
+    uint32_t blob_id;
+  };
+  std::mutex damage_blobs_lock_;
+  std::map<uint32_t, DamageBlob> damage_blobs_;
+
+  std::mutex committed_state_lock_;
+  DrmCommittedState committed_state_;
+
+  // Shared with the page flip handlers, which the event listener may run
+  // after we stopped waiting for their flip or are gone
+  std::shared_ptr<CompositorFlipState> flip_state_;
 };
 }  // namespace android
 
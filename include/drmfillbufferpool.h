@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_FILL_BUFFER_POOL_H_
+#define ANDROID_DRM_FILL_BUFFER_POOL_H_
+
+#include "drmhwcgralloc.h"
+
+#include <list>
+#include <memory>
+#include <utility>
+
+namespace android {
+
+class DrmBufferReaper;
+class DrmDevice;
+
+// Framebuffers filled with a single color, to show SolidColor layers on a
+// plane without the GPU. They're as large as the frame they fill, since many
+// planes can't scale a small buffer up that far. The most recently used ones
+// are kept around, a dim layer or letterbox bars keep the same color for
+// many frames.
+class DrmFillBufferPool {
+ public:
+  // Buffers no longer used are released through reaper, if given
+  DrmFillBufferPool(DrmDevice *drm, DrmBufferReaper *reaper,
+                    size_t max_buffers = 4);
+  DrmFillBufferPool(const DrmFillBufferPool &) = delete;
+  DrmFillBufferPool &operator=(const DrmFillBufferPool &) = delete;
+
+  // Returns a DRM_FORMAT_ARGB8888 framebuffer filled with pixel, at least
+  // width x height large. The buffer stays valid for as long as bo is held,
+  // even once evicted from the pool.
+  int GetBuffer(uint32_t pixel, uint32_t width, uint32_t height,
+                std::shared_ptr<hwc_drm_bo> *bo);
+
+  size_t size() const {
+    return buffers_.size();
+  }
+
+ private:
+  int CreateBuffer(uint32_t pixel, uint32_t width, uint32_t height,
+                   std::shared_ptr<hwc_drm_bo> *bo);
+
+  DrmDevice *drm_;
+  DrmBufferReaper *reaper_;
+  size_t max_buffers_;
+
+  // Most recently used first
+  std::list<std::pair<uint32_t, std::shared_ptr<hwc_drm_bo>>> buffers_;
+};
+}  // namespace android
+
+#endif
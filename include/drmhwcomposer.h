@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <memory>
 #include <vector>
 
 #include <hardware/hardware.h>
@@ -39,32 +40,33 @@ bool hwc_import_bo_release(int fd, struct hwc_import_context *ctx,
 
 namespace android {
 
+class DrmBufferCache;
+class DrmBufferReaper;
+class DrmFillBufferPool;
 class Importer;
 
+// Hands a framebuffer back to its importer once the last reference is gone,
+// through the reaper thread if there is one
+struct DrmHwcBoReleaser {
+  Importer *importer;
+  DrmBufferReaper *reaper = NULL;
+
+  void operator()(hwc_drm_bo_t *bo) const;
+};
+
 class DrmHwcBuffer {
  public:
   DrmHwcBuffer() = default;
   DrmHwcBuffer(const hwc_drm_bo &bo, Importer *importer)
-      : bo_(bo), importer_(importer) {
-  }
-  DrmHwcBuffer(DrmHwcBuffer &&rhs) : bo_(rhs.bo_), importer_(rhs.importer_) {
-    rhs.importer_ = NULL;
-  }
-
-  ~DrmHwcBuffer() {
-    Clear();
+      : bo_(new hwc_drm_bo(bo), DrmHwcBoReleaser{importer}) {
   }
-
-  DrmHwcBuffer &operator=(DrmHwcBuffer &&rhs) {
-    Clear();
-    importer_ = rhs.importer_;
-    rhs.importer_ = NULL;
-    bo_ = rhs.bo_;
-    return *this;
+  DrmHwcBuffer(std::shared_ptr<hwc_drm_bo> bo) : bo_(std::move(bo)) {
   }
+  DrmHwcBuffer(DrmHwcBuffer &&rhs) = default;
+  DrmHwcBuffer &operator=(DrmHwcBuffer &&rhs) = default;
 
   operator bool() const {
-    return importer_ != NULL;
+    return bo_ != NULL;
   }
 
   const hwc_drm_bo *operator->() const;
@@ -74,42 +76,29 @@ class DrmHwcBuffer {
   int ImportBuffer(buffer_handle_t handle, Importer *importer);
 
  private:
-  hwc_drm_bo bo_;
-  Importer *importer_ = NULL;
+  std::shared_ptr<hwc_drm_bo> bo_;
 };
 
+// Handle imported into the GraphicBufferMapper. Copies share the import, the
+// handle is freed once the last one is cleared.
 class DrmHwcNativeHandle {
  public:
   DrmHwcNativeHandle() = default;
 
-  DrmHwcNativeHandle(native_handle_t *handle) : handle_(handle) {
-  }
-
-  DrmHwcNativeHandle(DrmHwcNativeHandle &&rhs) {
-    handle_ = rhs.handle_;
-    rhs.handle_ = NULL;
-  }
-
-  ~DrmHwcNativeHandle();
-
-  DrmHwcNativeHandle &operator=(DrmHwcNativeHandle &&rhs) {
-    Clear();
-    handle_ = rhs.handle_;
-    rhs.handle_ = NULL;
-    return *this;
-  }
+  DrmHwcNativeHandle(native_handle_t *handle);
 
   int CopyBufferHandle(buffer_handle_t handle, int width, int height,
                        int layerCount, int format, int usage, int stride);
+  int CopyBufferHandle(buffer_handle_t handle, const hwc_drm_bo_t *bo);
 
   void Clear();
 
   buffer_handle_t get() const {
-    return handle_;
+    return handle_.get();
   }
 
  private:
-  native_handle_t *handle_ = NULL;
+  std::shared_ptr<native_handle_t> handle_;
 };
 
 enum DrmHwcTransform {
@@ -127,6 +116,9 @@ enum class DrmHwcBlending : int32_t {
   kCoverage = HWC_BLENDING_COVERAGE,
 };
 
+// Opaque black, the CRTC background color when no layer sets one
+const uint64_t kDefaultBackgroundColor = 0xffffULL << 48;
+
 struct DrmHwcLayer {
   buffer_handle_t sf_handle = NULL;
   int gralloc_buffer_usage = 0;
@@ -138,15 +130,43 @@ struct DrmHwcLayer {
   hwc_frect_t source_crop;
   hwc_rect_t display_frame;
 
+  // Regions of the buffer changed since the layer's last frame, in buffer
+  // coordinates. Empty if the whole buffer may have changed.
+  std::vector<hwc_rect_t> damage;
+
+  // SurfaceFlinger's cursor, goes on a cursor plane
+  bool cursor = false;
+
   UniqueFd acquire_fence;
   OutputFd release_fence;
 
+  // SolidColor layers have no buffer of their own, they're shown with a fill
+  // buffer or the CRTC background color. color is non-premultiplied ARGB8888.
+  bool solid_color = false;
+  uint32_t color = 0;
+
   int ImportBuffer(Importer *importer);
+  int ImportBuffer(DrmBufferCache *cache, const void *owner);
+  int ImportFillBuffer(DrmFillBufferPool *pool);
   int InitFromDrmHwcLayer(DrmHwcLayer *layer, Importer *importer);
 
   void SetTransform(int32_t sf_transform);
   void SetSourceCrop(hwc_frect_t const &crop);
   void SetDisplayFrame(hwc_rect_t const &frame);
+  // Shrinks the display frame to its intersection with frame, and the source
+  // crop along with it. Only done for layers without a transform.
+  void CropToFrame(hwc_rect_t const &frame);
+
+  // Whether the source crop is shown at a different size than its own
+  bool IsScaled() const;
+
+  // The transform as DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* bits
+  uint64_t GetDrmRotation() const;
+
+  // The pixel of the fill buffer, premultiplied if the blending expects it
+  uint32_t FillPixel() const;
+  // The color blended over black, as the DRM_ARGB64 CRTC background
+  uint64_t BackgroundColor() const;
 
   buffer_handle_t get_usable_handle() const {
     return handle.get() != NULL ? handle.get() : sf_handle;
@@ -15,7 +15,9 @@
  */
 
 #include "drmdisplaycompositor.h"
+#include "drmfillbufferpool.h"
 #include "drmhwcomposer.h"
+#include "importworker.h"
 #include "platform.h"
 #include "resourcemanager.h"
 #include "vsyncworker.h"
@@ -23,6 +25,7 @@
 #include <hardware/hwcomposer2.h>
 
 #include <map>
+#include <tuple>
 
 namespace android {
 
@@ -58,6 +61,25 @@ class DrmHwcTwo : public hwc2_device_t {
       return z_order_;
     }
 
+    // Whether anything deciding the layer's plane or its TEST_ONLY result
+    // changed since the last composition
+    bool geometry_changed() const {
+      return geometry_changed_;
+    }
+    void clear_geometry_changed() {
+      geometry_changed_ = false;
+    }
+
+    // Whether SurfaceFlinger says the layers above cover all of this one
+    bool occluded() const {
+      return visible_region_set_ && (visible_bounds_.left >=
+                                         visible_bounds_.right ||
+                                     visible_bounds_.top >=
+                                         visible_bounds_.bottom);
+    }
+    void UpdateBufferLayout(uint32_t width, uint32_t height, uint32_t format,
+                            uint64_t modifier);
+
     buffer_handle_t buffer() {
       return buffer_;
     }
@@ -78,6 +100,9 @@ class DrmHwcTwo : public hwc2_device_t {
     int take_release_fence() {
       return release_fence_.Release();
     }
+    void set_release_fence(int release_fence) {
+      release_fence_.Set(release_fence);
+    }
     void manage_release_fence() {
       release_fence_.Set(release_fence_raw_);
       release_fence_raw_ = -1;
@@ -87,6 +112,8 @@ class DrmHwcTwo : public hwc2_device_t {
     }
 
     void PopulateDrmLayer(DrmHwcLayer *layer);
+    // Everything but the fences, for planning without consuming them
+    void PopulateDrmLayerState(DrmHwcLayer *layer);
 
     // Layer hooks
     HWC2::Error SetCursorPosition(int32_t x, int32_t y);
@@ -118,11 +145,18 @@ class DrmHwcTwo : public hwc2_device_t {
     hwc_rect_t display_frame_;
     float alpha_ = 1.0f;
     hwc_frect_t source_crop_;
+    hwc_color_t color_ = {0, 0, 0, 0};
+    std::vector<hwc_rect_t> damage_;
+    hwc_rect_t visible_bounds_ = {0, 0, 0, 0};
+    bool visible_region_set_ = false;
     int32_t cursor_x_;
     int32_t cursor_y_;
     HWC2::Transform transform_ = HWC2::Transform::None;
     uint32_t z_order_ = 0;
     android_dataspace_t dataspace_ = HAL_DATASPACE_UNKNOWN;
+
+    bool geometry_changed_ = true;
+    std::tuple<uint32_t, uint32_t, uint32_t, uint64_t> buffer_layout_;
   };
 
   struct HwcCallback {
@@ -177,8 +211,11 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error ChosePreferredConfig();
     HWC2::Error SetClientTarget(buffer_handle_t target, int32_t acquire_fence,
                                 int32_t dataspace, hwc_region_t damage);
+    HWC2::Error SetCursorPosition(hwc2_layer_t layer, int32_t x, int32_t y);
     HWC2::Error SetColorMode(int32_t mode);
     HWC2::Error SetColorTransform(const float *matrix, int32_t hint);
+    HWC2::Error SetLayerBuffer(hwc2_layer_t layer, buffer_handle_t buffer,
+                               int32_t acquire_fence);
     HWC2::Error SetOutputBuffer(buffer_handle_t buffer, int32_t release_fence);
     HWC2::Error SetPowerMode(int32_t mode);
     HWC2::Error SetVsyncEnabled(int32_t enabled);
@@ -189,18 +226,66 @@ class DrmHwcTwo : public hwc2_device_t {
 
    private:
     HWC2::Error CreateComposition(bool test);
+    HWC2::Error ApplyValidatedComposition();
+    void ClearValidatedComposition();
+    bool CanSkipValidate();
+    bool CanUseCursorPlane(HwcLayer *layer);
+    bool CanUseBackgroundColor(HwcLayer *layer);
+    void SetValidatedTypes(std::map<uint32_t, HwcLayer *> *z_map,
+                           size_t client_start, size_t client_size);
+    bool GeometryChanged(const std::vector<HwcLayer *> &z_layers,
+                         const std::vector<DrmPlane *> &overlay_planes);
+    void CommitGeometry(const std::vector<HwcLayer *> &z_layers,
+                        const std::vector<DrmPlane *> &overlay_planes);
+    // The overlay planes the display may plan with, shared ones it holds
+    // included, and free ones too if free_shared is set
+    std::vector<DrmPlane *> GetOverlayPlanes(bool free_shared);
+    HWC2::Error CommitComposition(
+        std::unique_ptr<DrmDisplayComposition> composition,
+        const std::vector<HwcLayer *> &z_layers,
+        const std::vector<DrmPlane *> &overlay_planes);
+    void SetReleaseFences(int present_fence);
     void AddFenceToRetireFence(int fd);
+    void PrefetchBuffer(buffer_handle_t buffer, const HwcLayer *owner);
 
     ResourceManager *resource_manager_;
     DrmDevice *drm_;
     DrmDisplayCompositor compositor_;
     std::shared_ptr<Importer> importer_;
+    std::shared_ptr<DrmBufferCache> buffer_cache_;
     std::unique_ptr<Planner> planner_;
+    std::unique_ptr<DrmFillBufferPool> fill_buffers_;
+
+    // The composition tested by ValidateDisplay and the layers it was built
+    // from, in z order, so PresentDisplay needn't build and test it again
+    std::unique_ptr<DrmDisplayComposition> validated_composition_;
+    std::vector<HwcLayer *> validated_layers_;
+    std::vector<DrmPlane *> validated_overlay_planes_;
+    // Whether ValidateDisplay ran since the last PresentDisplay
+    bool validated_ = false;
+
+    // Bumped when something besides the layers changes what fits on the
+    // planes, such as the mode. Frames of an already committed generation,
+    // with the same layers and none of them changed, skip the TEST_ONLY
+    // commit.
+    uint64_t geometry_generation_ = 1;
+    uint64_t committed_generation_ = 0;
+    std::vector<HwcLayer *> composited_layers_;
+    // The overlay planes, free shared ones included, the last committed
+    // frame was planned with
+    std::vector<DrmPlane *> overlay_planes_used_;
 
     std::vector<DrmPlane *> primary_planes_;
     std::vector<DrmPlane *> overlay_planes_;
+    bool use_overlay_planes_ = true;
+    std::vector<DrmPlane *> cursor_planes_;
+    uint32_t cursor_width_ = 64;
+    uint32_t cursor_height_ = 64;
+    // SolidColor layer shown as the CRTC background rather than on a plane
+    HwcLayer *background_layer_ = NULL;
 
     VSyncWorker vsync_worker_;
+    ImportWorker import_worker_;
     DrmConnector *connector_ = NULL;
     DrmCrtc *crtc_ = NULL;
     hwc2_display_t handle_;
@@ -209,10 +294,13 @@ class DrmHwcTwo : public hwc2_device_t {
     std::map<hwc2_layer_t, HwcLayer> layers_;
     HwcLayer client_layer_;
     UniqueFd retire_fence_;
-    UniqueFd next_retire_fence_;
+    // Layers whose buffers the last frame scanned out
+    std::vector<HwcLayer *> scanned_out_layers_;
     int32_t color_mode_;
 
     uint32_t frame_no_ = 0;
+    // TEST_ONLY commits ValidateDisplay may spend finding a plan per frame
+    int max_validate_tests_ = 0;
   };
 
   class DrmHotplugHandler : public DrmEventHandler {
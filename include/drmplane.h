@@ -22,11 +22,16 @@
 
 #include <stdint.h>
 #include <xf86drmMode.h>
+#include <map>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace android {
 
 class DrmDevice;
+enum class DrmHwcBlending : int32_t;
 
 class DrmPlane {
  public:
@@ -42,6 +47,14 @@ class DrmPlane {
 
   uint32_t type() const;
 
+  bool IsFormatSupported(uint32_t format) const;
+  bool IsFormatSupported(uint32_t format, uint64_t modifier) const;
+  // rotation is a combination of DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_*
+  bool IsRotationSupported(uint64_t rotation) const;
+  // Returns the pixel blend mode enum value for blending, or -EINVAL if the
+  // plane can't do it
+  std::tuple<uint64_t, int> GetBlendValue(DrmHwcBlending blending) const;
+
   const DrmProperty &crtc_property() const;
   const DrmProperty &fb_property() const;
   const DrmProperty &crtc_x_property() const;
@@ -57,8 +70,20 @@ class DrmPlane {
   const DrmProperty &alpha_property() const;
   const DrmProperty &blend_property() const;
   const DrmProperty &in_fence_fd_property() const;
+  const DrmProperty &damage_clips_property() const;
 
  private:
+  typedef std::pair<uint32_t, uint64_t> FormatModifier;
+
+  struct FormatModifierHash {
+    size_t operator()(const FormatModifier &fm) const {
+      return std::hash<uint64_t>()(fm.second) ^
+             std::hash<uint32_t>()(fm.first);
+    }
+  };
+
+  int ParseInFormats(const DrmProperty &in_formats);
+
   DrmDevice *drm_;
   uint32_t id_;
 
@@ -66,6 +91,14 @@ class DrmPlane {
 
   uint32_t type_;
 
+  std::unordered_set<uint32_t> formats_;
+  // Only filled if the plane exposes IN_FORMATS
+  std::unordered_set<FormatModifier, FormatModifierHash> format_modifiers_;
+  // Planes without a rotation property can't do anything but scan out as is
+  uint64_t rotations_ = DRM_MODE_ROTATE_0;
+  // Resolved once from the pixel blend mode enum names
+  std::map<DrmHwcBlending, uint64_t> blend_values_;
+
   DrmProperty crtc_property_;
   DrmProperty fb_property_;
   DrmProperty crtc_x_property_;
@@ -81,6 +114,7 @@ class DrmPlane {
   DrmProperty alpha_property_;
   DrmProperty blend_property_;
   DrmProperty in_fence_fd_property_;
+  DrmProperty damage_clips_property_;
 };
 }  // namespace android
 
@@ -41,6 +41,8 @@ class DrmProperty {
 
   void Init(drmModePropertyPtr p, uint64_t value);
   std::tuple<uint64_t, int> GetEnumValueWithName(std::string name) const;
+  // The bits a bitmask property accepts, its enum values are bit numbers
+  uint64_t GetBitmask() const;
 
   uint32_t id() const;
   std::string name() const;
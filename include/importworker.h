@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_IMPORT_WORKER_H_
+#define ANDROID_IMPORT_WORKER_H_
+
+#include "worker.h"
+
+#include <deque>
+#include <memory>
+
+#include <cutils/native_handle.h>
+
+namespace android {
+
+class DrmBufferCache;
+
+// Imports buffers into a DrmBufferCache as soon as SurfaceFlinger hands them
+// over, so that by the time the display is validated and presented the
+// buffers are already imported and CreateComposition only has to look them
+// up.
+class ImportWorker : public Worker {
+ public:
+  ImportWorker();
+  ~ImportWorker() override;
+
+  int Init(std::shared_ptr<DrmBufferCache> cache);
+
+  // Starts importing handle on behalf of owner. The handle is cloned, so it
+  // needn't outlive the call. A request still queued for the same owner is
+  // replaced, only the latest buffer of a layer is worth importing.
+  int Queue(buffer_handle_t handle, const void *owner);
+
+  // Drops the requests queued for owner and waits for the one being imported,
+  // if any. Nothing is imported on behalf of owner once this returns.
+  void Cancel(const void *owner);
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Request {
+    native_handle_t *handle;
+    const void *owner;
+  };
+
+  static void FreeHandle(native_handle_t *handle);
+
+  std::shared_ptr<DrmBufferCache> cache_;
+
+  // Protected by the worker lock
+  std::deque<Request> queue_;
+  const void *importing_ = NULL;
+};
+}  // namespace android
+
+#endif
@@ -23,7 +23,9 @@
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
+#include <list>
 #include <map>
+#include <mutex>
 #include <vector>
 
 #define UNUSED(x) (void)(x)
@@ -68,6 +70,8 @@ class Planner {
                                 DrmCrtc *crtc,
                                 std::vector<DrmPlane *> *planes) = 0;
 
+    static int ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer);
+
    protected:
     // Removes and returns the next available plane from planes
     static DrmPlane *PopPlane(std::vector<DrmPlane *> *planes) {
@@ -78,8 +82,6 @@ class Planner {
       return plane;
     }
 
-    static int ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer);
-
     // Inserts the given layer:plane in the composition at the back
     static int Emplace(std::vector<DrmCompositionPlane> *composition,
                        std::vector<DrmPlane *> *planes,
@@ -116,14 +118,44 @@ class Planner {
   // @layers: a map of index:layer of layers to composite
   // @primary_planes: a vector of primary planes available for this frame
   // @overlay_planes: a vector of overlay planes available for this frame
+  // @plan_id: if not NULL, receives the id the plan is cached under
   //
   // Returns: A tuple with the status of the operation (0 for success) and
   //          a vector of the resulting plan (ie: layer->plane mapping).
   std::tuple<int, std::vector<DrmCompositionPlane>> ProvisionPlanes(
       std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
       std::vector<DrmPlane *> *primary_planes,
+      std::vector<DrmPlane *> *overlay_planes, uint64_t *plan_id = NULL);
+
+  // Records that the TEST_ONLY commit of a cached plan passed, so the same
+  // stack needn't be tested again. Failures aren't kept, they may well pass
+  // once another display has let go of some bandwidth.
+  void SetTestPassed(uint64_t plan_id);
+
+  // Returns false if the plan didn't pass a test, or isn't cached anymore
+  bool TestPassed(uint64_t plan_id) const;
+
+  // Forgets all plans, for when they no longer hold (eg: after a modeset, a
+  // hotplug or turning the display off)
+  void ClearPlanCache();
+
+  // Picks the layers to composite on the GPU when the stack doesn't fit on the
+  // planes. The client target takes a plane of its own and has a single z
+  // position, so the layers going to the GPU must be contiguous.
+  //
+  // @layers: the stack in z order, NULL for layers that can't go on a plane
+  //
+  // Returns: The first layer and the number of layers going to the GPU,
+  //          chosen to cover the layers that can't go on a plane and to cost
+  //          the GPU the fewest pixels.
+  std::tuple<size_t, size_t> GetClientRange(
+      const std::vector<DrmHwcLayer *> &layers, DrmCrtc *crtc,
+      std::vector<DrmPlane *> *primary_planes,
       std::vector<DrmPlane *> *overlay_planes);
 
+  // Estimates what compositing the layer on the GPU costs, in pixels
+  static uint64_t ClientCost(const DrmHwcLayer *layer);
+
   template <typename T, typename... A>
   void AddStage(A &&... args) {
     stages_.emplace_back(
@@ -135,7 +167,32 @@ class Planner {
       DrmCrtc *crtc, std::vector<DrmPlane *> *primary_planes,
       std::vector<DrmPlane *> *overlay_planes);
 
+  // A plan and its test result, for a stack of layers on a set of planes
+  struct CachedPlan {
+    uint64_t id;
+    size_t hash;
+    std::vector<uint64_t> signature;
+    int ret;
+    std::vector<DrmCompositionPlane> composition;
+    bool test_passed;
+  };
+
+  static const size_t kMaxCachedPlans = 8;
+
+  // Everything about the layers and planes that can change the plan or the
+  // test result
+  static std::vector<uint64_t> GetSignature(
+      const std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+      const std::vector<DrmPlane *> &planes);
+  static std::vector<DrmCompositionPlane> CopyComposition(
+      const std::vector<DrmCompositionPlane> &composition);
+
   std::vector<std::unique_ptr<PlanStage>> stages_;
+
+  // Most recently used first. Hotplug clears it from the event listener.
+  mutable std::mutex plan_cache_lock_;
+  std::list<CachedPlan> plan_cache_;
+  uint64_t next_plan_id_ = 1;
 };
 
 // This plan stage extracts all protected layers and places them on dedicated
@@ -147,6 +204,15 @@ class PlanStageProtected : public Planner::PlanStage {
                       std::vector<DrmPlane *> *planes);
 };
 
+// This plan stage puts cursor layers on cursor planes, and takes the cursor
+// planes out of the pool so no other layer ends up on them.
+class PlanStageCursor : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *planes);
+};
+
 // This plan stage places as many layers on dedicated planes as possible (first
 // come first serve), and then sticks the rest in a precomposition plane (if
 // needed).
@@ -17,11 +17,16 @@
 #ifndef RESOURCEMANAGER_H
 #define RESOURCEMANAGER_H
 
+#include "drmbuffercache.h"
+#include "drmbufferreaper.h"
 #include "drmdevice.h"
 #include "platform.h"
 
 #include <string.h>
 
+#include <map>
+#include <mutex>
+
 namespace android {
 
 class ResourceManager {
@@ -32,6 +37,8 @@ class ResourceManager {
   int Init();
   DrmDevice *GetDrmDevice(int display);
   std::shared_ptr<Importer> GetImporter(int display);
+  std::shared_ptr<DrmBufferCache> GetBufferCache(int display);
+  DrmBufferReaper *GetBufferReaper(int display);
   const gralloc_module_t *gralloc();
   DrmConnector *AvailableWritebackConnector(int display);
   const std::vector<std::unique_ptr<DrmDevice>> &getDrmDevices() const {
@@ -41,13 +48,39 @@ class ResourceManager {
     return num_displays_;
   }
 
+  // Overlay planes more than one display can use are shared between them.
+  // A display holds a plane from the frame it's first planned on until a
+  // commit of that display disabling it is on screen, and only free planes
+  // are lent out, so a plane never moves between CRTCs within a single commit.
+  // They start out disabled and free, and a display that's turned off hands
+  // its planes back.
+  bool IsSharedPlane(DrmPlane *plane);
+  bool HoldsSharedPlane(int display, DrmPlane *plane);
+  // The shared planes display can plan with, the free ones and its own
+  std::vector<DrmPlane *> GetSharedPlanes(int display);
+  // Fails with -EBUSY, holding none of them, if another display holds any
+  int ClaimSharedPlanes(int display, const std::vector<DrmPlane *> &planes);
+  void ReleaseSharedPlanes(int display, const std::vector<DrmPlane *> &planes);
+
  private:
+  struct SharedPlane {
+    DrmDevice *drm;
+    int holder;
+  };
+
   int AddDrmDevice(std::string path);
+  void FindSharedPlanes(DrmDevice *drm, int first_display, int num_displays);
 
   int num_displays_;
   std::vector<std::unique_ptr<DrmDevice>> drms_;
   std::vector<std::shared_ptr<Importer>> importers_;
+  // Declared after the importers, so they outlive the buffers released here
+  std::vector<std::unique_ptr<DrmBufferReaper>> reapers_;
+  std::vector<std::shared_ptr<DrmBufferCache>> buffer_caches_;
   const gralloc_module_t *gralloc_;
+
+  std::mutex shared_planes_lock_;
+  std::map<DrmPlane *, SharedPlane> shared_planes_;
 };
 }  // namespace android
 
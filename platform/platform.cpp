@@ -19,7 +19,12 @@
 #include "platform.h"
 #include "drmdevice.h"
 
+#include <drm/drm_fourcc.h>
 #include <log/log.h>
+#include <string.h>
+#include <algorithm>
+#include <cinttypes>
+#include <functional>
 
 namespace android {
 
@@ -40,9 +45,32 @@ int Planner::PlanStage::ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer) {
   int ret = 0;
   uint64_t blend;
 
-  if ((plane->rotation_property().id() == 0) &&
-      layer->transform != DrmHwcTransform::kIdentity) {
-    ALOGE("Rotation is not supported on plane %d", plane->id());
+  if (layer->buffer) {
+    uint32_t format = layer->buffer->format;
+    uint64_t modifier = layer->buffer->modifiers[0];
+    // An invalid modifier leaves the layout up to the driver
+    bool supported = modifier == DRM_FORMAT_MOD_INVALID
+                         ? plane->IsFormatSupported(format)
+                         : plane->IsFormatSupported(format, modifier);
+    if (!supported) {
+      ALOGV("Format 0x%x modifier 0x%" PRIx64 " is not supported on plane %d",
+            format, modifier, plane->id());
+      return -EINVAL;
+    }
+  }
+
+  // Cursor planes can rarely scale, and fill buffers are as large as the
+  // frame they fill. A scaled one has been cropped or transformed since.
+  if ((plane->type() == DRM_PLANE_TYPE_CURSOR || layer->solid_color) &&
+      layer->IsScaled()) {
+    ALOGV("Layer can't be scaled on plane %d", plane->id());
+    return -EINVAL;
+  }
+
+  uint64_t rotation = layer->GetDrmRotation();
+  if (!plane->IsRotationSupported(rotation)) {
+    ALOGV("Rotation 0x%" PRIx64 " is not supported on plane %d", rotation,
+          plane->id());
     return -EINVAL;
   }
 
@@ -58,21 +86,7 @@ int Planner::PlanStage::ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer) {
       return -EINVAL;
     }
   } else {
-    switch (layer->blending) {
-      case DrmHwcBlending::kPreMult:
-        std::tie(blend, ret) = plane->blend_property().GetEnumValueWithName(
-            "Pre-multiplied");
-        break;
-      case DrmHwcBlending::kCoverage:
-        std::tie(blend, ret) = plane->blend_property().GetEnumValueWithName(
-            "Coverage");
-        break;
-      case DrmHwcBlending::kNone:
-      default:
-        std::tie(blend,
-                 ret) = plane->blend_property().GetEnumValueWithName("None");
-        break;
-    }
+    std::tie(blend, ret) = plane->GetBlendValue(layer->blending);
     if (ret)
       ALOGE("Expected a valid blend mode on plane %d", plane->id());
   }
@@ -80,10 +94,75 @@ int Planner::PlanStage::ValidatePlane(DrmPlane *plane, DrmHwcLayer *layer) {
   return ret;
 }
 
+std::vector<uint64_t> Planner::GetSignature(
+    const std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    const std::vector<DrmPlane *> &planes) {
+  auto float_bits = [](float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  };
+
+  std::vector<uint64_t> signature;
+  signature.push_back(crtc->id());
+  signature.push_back(planes.size());
+  for (DrmPlane *plane : planes)
+    signature.push_back(plane->id());
+
+  for (const std::pair<const size_t, DrmHwcLayer *> &l : layers) {
+    const DrmHwcLayer *layer = l.second;
+    signature.push_back(l.first);
+    // The kernel checks the framebuffer against each plane's size, pitch
+    // and format limits, not just the source crop
+    if (layer->buffer) {
+      signature.push_back(layer->buffer->width);
+      signature.push_back(layer->buffer->height);
+      signature.push_back(layer->buffer->pitches[0]);
+      signature.push_back(layer->buffer->format);
+      signature.push_back(layer->buffer->modifiers[0]);
+    } else {
+      signature.insert(signature.end(), 5, 0);
+    }
+    signature.push_back(float_bits(layer->source_crop.left));
+    signature.push_back(float_bits(layer->source_crop.top));
+    signature.push_back(float_bits(layer->source_crop.right));
+    signature.push_back(float_bits(layer->source_crop.bottom));
+    // The cursor moves around without changing the plan, only its size counts
+    if (layer->cursor) {
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.right -
+                                                layer->display_frame.left));
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.bottom -
+                                                layer->display_frame.top));
+    } else {
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.left));
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.top));
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.right));
+      signature.push_back(static_cast<uint32_t>(layer->display_frame.bottom));
+    }
+    signature.push_back(layer->transform);
+    signature.push_back(layer->alpha);
+    signature.push_back(static_cast<uint64_t>(layer->blending));
+    signature.push_back(layer->protected_usage());
+    signature.push_back(layer->cursor);
+    signature.push_back(layer->solid_color);
+  }
+  return signature;
+}
+
+std::vector<DrmCompositionPlane> Planner::CopyComposition(
+    const std::vector<DrmCompositionPlane> &composition) {
+  std::vector<DrmCompositionPlane> copy;
+  for (const DrmCompositionPlane &plane : composition) {
+    copy.emplace_back(plane.type(), plane.plane(), plane.crtc());
+    copy.back().source_layers() = plane.source_layers();
+  }
+  return copy;
+}
+
 std::tuple<int, std::vector<DrmCompositionPlane>> Planner::ProvisionPlanes(
     std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
     std::vector<DrmPlane *> *primary_planes,
-    std::vector<DrmPlane *> *overlay_planes) {
+    std::vector<DrmPlane *> *overlay_planes, uint64_t *plan_id) {
   std::vector<DrmCompositionPlane> composition;
   std::vector<DrmPlane *> planes = GetUsablePlanes(crtc, primary_planes,
                                                    overlay_planes);
@@ -92,16 +171,154 @@ std::tuple<int, std::vector<DrmCompositionPlane>> Planner::ProvisionPlanes(
     return std::make_tuple(-ENODEV, std::vector<DrmCompositionPlane>());
   }
 
+  // Stacks tend to repeat, eg: switching between the same few UI screens
+  std::vector<uint64_t> signature = GetSignature(layers, crtc, planes);
+  size_t hash = 0;
+  for (uint64_t value : signature)
+    hash = hash * 31 + std::hash<uint64_t>()(value);
+  std::unique_lock<std::mutex> lock(plan_cache_lock_);
+  for (auto it = plan_cache_.begin(); it != plan_cache_.end(); ++it) {
+    if (it->hash != hash || it->signature != signature)
+      continue;
+    plan_cache_.splice(plan_cache_.begin(), plan_cache_, it);
+    if (plan_id)
+      *plan_id = it->id;
+    return std::make_tuple(it->ret, CopyComposition(it->composition));
+  }
+
+  lock.unlock();
+
   // Go through the provisioning stages and provision planes
+  int ret = 0;
   for (auto &i : stages_) {
-    int ret = i->ProvisionPlanes(&composition, layers, crtc, &planes);
+    ret = i->ProvisionPlanes(&composition, layers, crtc, &planes);
     if (ret) {
       ALOGE("Failed provision stage with ret %d", ret);
-      return std::make_tuple(ret, std::vector<DrmCompositionPlane>());
+      composition.clear();
+      break;
     }
   }
 
-  return std::make_tuple(0, std::move(composition));
+  lock.lock();
+  plan_cache_.push_front(CachedPlan{next_plan_id_++, hash, std::move(signature),
+                                    ret, CopyComposition(composition), false});
+  if (plan_cache_.size() > kMaxCachedPlans)
+    plan_cache_.pop_back();
+  if (plan_id)
+    *plan_id = plan_cache_.front().id;
+
+  return std::make_tuple(ret, std::move(composition));
+}
+
+void Planner::SetTestPassed(uint64_t plan_id) {
+  std::lock_guard<std::mutex> lock(plan_cache_lock_);
+  for (CachedPlan &plan : plan_cache_) {
+    if (plan.id != plan_id)
+      continue;
+    plan.test_passed = true;
+    return;
+  }
+}
+
+bool Planner::TestPassed(uint64_t plan_id) const {
+  std::lock_guard<std::mutex> lock(plan_cache_lock_);
+  for (const CachedPlan &plan : plan_cache_) {
+    if (plan.id == plan_id)
+      return plan.test_passed;
+  }
+  return false;
+}
+
+void Planner::ClearPlanCache() {
+  std::lock_guard<std::mutex> lock(plan_cache_lock_);
+  plan_cache_.clear();
+}
+
+uint64_t Planner::ClientCost(const DrmHwcLayer *layer) {
+  uint64_t dst_w = layer->display_frame.right - layer->display_frame.left;
+  uint64_t dst_h = layer->display_frame.bottom - layer->display_frame.top;
+  uint64_t cost = dst_w * dst_h;
+  if (!layer->buffer)
+    return cost;
+
+  // Downscaling makes the GPU sample more pixels than it writes
+  uint64_t src_w = layer->source_crop.right - layer->source_crop.left;
+  uint64_t src_h = layer->source_crop.bottom - layer->source_crop.top;
+  cost = std::max(cost, src_w * src_h);
+
+  // YUV has to be converted, and takes more than one fetch per pixel
+  switch (layer->buffer->format) {
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
+    case DRM_FORMAT_P010:
+    case DRM_FORMAT_YVU420:
+      cost += cost / 2;
+      break;
+    default:
+      break;
+  }
+  return cost;
+}
+
+std::tuple<size_t, size_t> Planner::GetClientRange(
+    const std::vector<DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *primary_planes,
+    std::vector<DrmPlane *> *overlay_planes) {
+  std::vector<DrmPlane *> planes = GetUsablePlanes(crtc, primary_planes,
+                                                   overlay_planes);
+  planes.erase(std::remove_if(planes.begin(), planes.end(),
+                              [](DrmPlane *plane) {
+                                return plane->type() == DRM_PLANE_TYPE_CURSOR;
+                              }),
+               planes.end());
+  size_t num_layers = layers.size();
+
+  // The range has to cover every layer that no plane can scan out
+  size_t first_forced = num_layers;
+  size_t last_forced = 0;
+  std::vector<uint64_t> costs(num_layers + 1, 0);
+  for (size_t i = 0; i < num_layers; ++i) {
+    DrmHwcLayer *layer = layers[i];
+    bool forced = !layer ||
+                  std::none_of(planes.begin(), planes.end(),
+                               [=](DrmPlane *plane) {
+                                 return !PlanStage::ValidatePlane(plane, layer);
+                               });
+    if (forced) {
+      first_forced = std::min(first_forced, i);
+      last_forced = i;
+    }
+    // Prefix sums, costs[j] - costs[i] is the cost of layers [i, j)
+    costs[i + 1] = costs[i] + (layer ? ClientCost(layer) : 0);
+  }
+
+  if (first_forced == num_layers && num_layers <= planes.size())
+    return std::make_tuple(0, 0);
+  if (planes.size() < 2)
+    return std::make_tuple(0, num_layers);
+
+  // Whatever doesn't fit on the planes left next to the client target goes to
+  // the GPU too. Growing the range only adds to its cost, so the smallest
+  // range that does the job is the one to look for.
+  size_t size = num_layers - std::min(num_layers, planes.size() - 1);
+  size_t min_start = 0;
+  size_t max_start = num_layers - size;
+  if (first_forced != num_layers) {
+    size = std::max(size, last_forced - first_forced + 1);
+    min_start = last_forced + 1 >= size ? last_forced + 1 - size : 0;
+    max_start = std::min(first_forced, num_layers - size);
+  }
+
+  size_t best_start = min_start;
+  uint64_t best_cost = UINT64_MAX;
+  for (size_t start = min_start; start <= max_start; ++start) {
+    uint64_t cost = costs[start + size] - costs[start];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_start = start;
+    }
+  }
+  return std::make_tuple(best_start, size);
 }
 
 int PlanStageProtected::ProvisionPlanes(
@@ -130,6 +347,39 @@ int PlanStageProtected::ProvisionPlanes(
   return 0;
 }
 
+int PlanStageCursor::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *planes) {
+  std::vector<DrmPlane *> cursor_planes;
+  for (auto i = planes->begin(); i != planes->end();) {
+    if ((*i)->type() != DRM_PLANE_TYPE_CURSOR) {
+      ++i;
+      continue;
+    }
+    cursor_planes.push_back(*i);
+    i = planes->erase(i);
+  }
+
+  for (auto i = layers.begin(); i != layers.end();) {
+    if (!i->second->cursor) {
+      ++i;
+      continue;
+    }
+
+    int ret = Emplace(composition, &cursor_planes,
+                      DrmCompositionPlane::Type::kLayer, crtc,
+                      std::make_pair(i->first, i->second));
+    if (ret) {
+      ALOGE("Failed to put cursor layer %zu on a cursor plane", i->first);
+      return ret;
+    }
+    i = layers.erase(i);
+  }
+
+  return 0;
+}
+
 int PlanStageGreedy::ProvisionPlanes(
     std::vector<DrmCompositionPlane> *composition,
     std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
@@ -33,6 +33,59 @@ namespace pb = arm::graphics::privatebuffer::V1_0;
 
 namespace android {
 
+// Enough for the buffers of all layers on screen and some churn
+static const size_t kMaxCachedBufferInfo = 64;
+
+ArmgrBufferInfoCache::ArmgrBufferInfoCache(QueryFunc query, size_t max_size)
+    : query_(query), max_size_(max_size) {
+}
+
+int ArmgrBufferInfoCache::Get(buffer_handle_t handle, ArmgrBufferInfo *info,
+                              DrmBufferCache::BufferId *id) {
+  Key key;
+  int ret = DrmBufferCache::GetBufferId(handle, &key);
+  if (ret)
+    return ret;
+  *id = key;
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      *info = it->second.info;
+      return 0;
+    }
+  }
+
+  ArmgrBufferInfo tmp_info;
+  ret = query_(handle, &tmp_info);
+  if (ret)
+    return ret;
+
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    lru_.push_front(key);
+    entries_[key] = Entry{tmp_info, lru_.begin()};
+    while (entries_.size() > max_size_) {
+      entries_.erase(lru_.back());
+      lru_.pop_back();
+    }
+  }
+  *info = tmp_info;
+  return 0;
+}
+
+void ArmgrBufferInfoCache::Invalidate(const DrmBufferCache::BufferId &id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = entries_.find(id);
+  if (it == entries_.end())
+    return;
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
+
 Importer *Importer::CreateInstance(DrmDevice *drm) {
   ArmgrImporter *importer = new ArmgrImporter(drm);
   if (!importer)
@@ -48,7 +101,13 @@ Importer *Importer::CreateInstance(DrmDevice *drm) {
 }
 
 ArmgrImporter::ArmgrImporter(DrmDevice *drm)
-    : DrmGenericImporter(drm), drm_(drm) {
+    : DrmGenericImporter(drm),
+      drm_(drm),
+      info_cache_(
+          [this](buffer_handle_t handle, ArmgrBufferInfo *info) {
+            return QueryBufferInfo(handle, info);
+          },
+          kMaxCachedBufferInfo) {
 }
 
 ArmgrImporter::~ArmgrImporter() {
@@ -174,8 +233,45 @@ int ArmgrImporter::GetPlaneLayout(buffer_handle_t handle,
   return err;
 }
 
+int ArmgrImporter::QueryBufferInfo(buffer_handle_t handle,
+                                   ArmgrBufferInfo *info) {
+  int err = GetUsage(handle, &info->usage);
+  if (err)
+    return err;
+
+  // Nothing else is needed to reject the buffer
+  if (!(info->usage & gc::BufferUsage::COMPOSER_CLIENT_TARGET))
+    return 0;
+
+  int fd = GetFd(handle);
+  if (fd < 0)
+    return fd;
+
+  for (int i = 0; i < handle->numFds; ++i) {
+    if (handle->data[i] == fd) {
+      info->fd_index = i;
+      break;
+    }
+  }
+  if (info->fd_index < 0) {
+    ALOGE("shared fd %d is not part of the buffer handle", fd);
+    return -EINVAL;
+  }
+
+  err = GetFormat(handle, &info->hal_format, &info->format, &info->modifier);
+  if (err)
+    return err;
+
+  err = GetDimensions(handle, &info->width, &info->height);
+  if (err)
+    return err;
+
+  return GetPlaneLayout(handle, info->pitches, info->offsets);
+}
+
 int ArmgrImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
-  uint64_t modifiers[4] = {0};
+  ArmgrBufferInfo info;
+  DrmBufferCache::BufferId id;
   int err = 0, fd;
 
   if (!handle)
@@ -183,58 +279,72 @@ int ArmgrImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
 
   memset(bo, 0, sizeof(hwc_drm_bo_t));
 
-  err = GetUsage(handle, &bo->usage);
+  err = info_cache_.Get(handle, &info, &id);
 
   // We can't import these types of buffers.
   // These buffers should have been filtered out with CanImportBuffer()
-  if (err || !(bo->usage & gc::BufferUsage::COMPOSER_CLIENT_TARGET))
+  if (err || !(info.usage & gc::BufferUsage::COMPOSER_CLIENT_TARGET))
     return -EINVAL;
 
-  fd = GetFd(handle);
-  if (fd < 0)
-      return fd;
-
+  fd = handle->data[info.fd_index];
   err = drmPrimeFDToHandle(drm_->fd(), fd, &bo->gem_handles[0]);
   if (err) {
     ALOGE("failed to import prime fd %d ret=%d", fd, err);
     return err;
   }
 
-  err = GetFormat(handle, &bo->hal_format, &bo->format, &modifiers[0]);
-  if (err)
-      return err;
-
-  err = GetDimensions(handle, &bo->width, &bo->height);
-  if (err)
-      return err;
-
-  err = GetPlaneLayout(handle, bo->pitches, bo->offsets);
-  if (err)
-      return err;
+  bo->usage = info.usage;
+  bo->hal_format = info.hal_format;
+  bo->format = info.format;
+  bo->width = info.width;
+  bo->height = info.height;
+  memcpy(bo->pitches, info.pitches, sizeof(bo->pitches));
+  memcpy(bo->offsets, info.offsets, sizeof(bo->offsets));
 
+  bo->modifiers[0] = info.modifier;
   for (int i = 1; i < 4; ++i) {
     if (!bo->pitches[i])
       break;
     bo->gem_handles[i] = bo->gem_handles[0];
+    bo->modifiers[i] = info.modifier;
   }
 
   err = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
                                    bo->format, bo->gem_handles, bo->pitches,
-                                   bo->offsets, modifiers, &bo->fb_id,
-                                   modifiers[0] ? DRM_MODE_FB_MODIFIERS : 0);
-  if (err)
+                                   bo->offsets, bo->modifiers, &bo->fb_id,
+                                   info.modifier ? DRM_MODE_FB_MODIFIERS : 0);
+  if (err) {
     ALOGE("could not create drm fb %d", err);
+    return err;
+  }
 
-  return err;
+  std::lock_guard<std::mutex> lock(imported_lock_);
+  imported_[bo->fb_id] = id;
+  return 0;
+}
+
+int ArmgrImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
+  {
+    std::lock_guard<std::mutex> lock(imported_lock_);
+    auto it = imported_.find(bo->fb_id);
+    if (it != imported_.end()) {
+      // The metadata may not be valid once the buffer is gone
+      info_cache_.Invalidate(it->second);
+      imported_.erase(it);
+    }
+  }
+
+  return DrmGenericImporter::ReleaseBuffer(bo);
 }
 
 bool ArmgrImporter::CanImportBuffer(buffer_handle_t handle) {
-  uint32_t usage;
+  ArmgrBufferInfo info;
+  DrmBufferCache::BufferId id;
   int err;
 
-  err = GetUsage(handle, &usage);
+  err = info_cache_.Get(handle, &info, &id);
 
-  return !err && (usage & gc::BufferUsage::COMPOSER_CLIENT_TARGET);
+  return !err && (info.usage & gc::BufferUsage::COMPOSER_CLIENT_TARGET);
 }
 
 class PlanStageArmgr : public Planner::PlanStage {
@@ -273,6 +383,7 @@ class PlanStageArmgr : public Planner::PlanStage {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   auto planner = std::make_unique<Planner>();
+  planner->AddStage<PlanStageCursor>();
   planner->AddStage<PlanStageArmgr>();
   return planner;
 }
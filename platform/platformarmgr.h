@@ -17,10 +17,16 @@
 #ifndef ANDROID_PLATFORM_ARMGR_H_
 #define ANDROID_PLATFORM_ARMGR_H_
 
+#include "drmbuffercache.h"
 #include "drmdevice.h"
 #include "platform.h"
 #include "platformdrmgeneric.h"
 
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+
 #include <hardware/gralloc.h>
 
 #include <arm/graphics/privatebuffer/1.0/IAccessor.h>
@@ -28,6 +34,47 @@
 
 namespace android {
 
+// Everything the importer needs to know about a buffer from the gralloc
+struct ArmgrBufferInfo {
+  uint32_t usage = 0;
+  int fd_index = -1;  // index of the shared fd in the handle's data
+  uint32_t hal_format = 0;
+  uint32_t format = 0;
+  uint64_t modifier = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t pitches[HWC_DRM_BO_MAX_PLANES] = {0};
+  uint32_t offsets[HWC_DRM_BO_MAX_PLANES] = {0};
+};
+
+// Remembers the gralloc metadata of recently seen buffers so it only has to be
+// queried over HIDL once per buffer instead of on every validate and import.
+class ArmgrBufferInfoCache {
+ public:
+  typedef std::function<int(buffer_handle_t, ArmgrBufferInfo *)> QueryFunc;
+
+  ArmgrBufferInfoCache(QueryFunc query, size_t max_size);
+
+  int Get(buffer_handle_t handle, ArmgrBufferInfo *info,
+          DrmBufferCache::BufferId *id);
+  void Invalidate(const DrmBufferCache::BufferId &id);
+
+ private:
+  typedef DrmBufferCache::BufferId Key;
+
+  struct Entry {
+    ArmgrBufferInfo info;
+    std::list<Key>::iterator lru;
+  };
+
+  QueryFunc query_;
+  size_t max_size_;
+
+  std::mutex lock_;
+  std::list<Key> lru_;
+  std::map<Key, Entry> entries_;
+};
+
 class ArmgrImporter : public DrmGenericImporter {
 
  public:
@@ -38,10 +85,12 @@ class ArmgrImporter : public DrmGenericImporter {
   int Init();
 
   int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override;
+  int ReleaseBuffer(hwc_drm_bo_t *bo) override;
 
   bool CanImportBuffer(buffer_handle_t handle) override;
 
  private:
+  int QueryBufferInfo(buffer_handle_t handle, ArmgrBufferInfo *info);
 
   int GetUsage(buffer_handle_t handle, uint32_t *usage);
   int GetFd(buffer_handle_t handle);
@@ -54,6 +103,12 @@ class ArmgrImporter : public DrmGenericImporter {
   DrmDevice *drm_;
 
   android::sp<arm::graphics::privatebuffer::V1_0::IAccessor> armgr_acc_;
+
+  ArmgrBufferInfoCache info_cache_;
+
+  // Buffer each framebuffer was created from, to drop the metadata with it
+  std::mutex imported_lock_;
+  std::map<uint32_t, DrmBufferCache::BufferId> imported_;
 };
 }  // namespace android
 
@@ -24,6 +24,9 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <string.h>
+#include <algorithm>
+
 #include <cutils/properties.h>
 #include <gralloc_handle.h>
 #include <hardware/gralloc.h>
@@ -49,7 +52,7 @@ Importer *Importer::CreateInstance(DrmDevice *drm) {
 #endif
 
 DrmGenericImporter::DrmGenericImporter(DrmDevice *drm)
-    : drm_(drm), exclude_non_hwfb_(false) {
+    : drm_(drm), gralloc_(NULL), exclude_non_hwfb_(false) {
 }
 
 DrmGenericImporter::~DrmGenericImporter() {
@@ -87,6 +90,12 @@ uint32_t DrmGenericImporter::ConvertHalFormatToDrm(uint32_t hal_format) {
       return DRM_FORMAT_BGR565;
     case HAL_PIXEL_FORMAT_YV12:
       return DRM_FORMAT_YVU420;
+    case HAL_PIXEL_FORMAT_YCBCR_420_888:
+      return DRM_FORMAT_NV12;
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+      return DRM_FORMAT_NV21;
+    case HAL_PIXEL_FORMAT_YCBCR_P010:
+      return DRM_FORMAT_P010;
     default:
       ALOGE("Cannot convert hal format to drm format %u", hal_format);
       return -EINVAL;
@@ -103,40 +112,193 @@ uint32_t DrmGenericImporter::DrmFormatToBitsPerPixel(uint32_t drm_format) {
       return 24;
     case DRM_FORMAT_BGR565:
       return 16;
+    case DRM_FORMAT_YUV420:
     case DRM_FORMAT_YVU420:
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
       return 12;
+    case DRM_FORMAT_P010:
+      return 24;
     default:
       ALOGE("Cannot convert hal format %u to bpp (returning 32)", drm_format);
       return 32;
   }
 }
 
+// static
+bool DrmGenericImporter::HasExplicitModifier(const hwc_drm_bo_t *bo) {
+  return bo->modifiers[0] != DRM_FORMAT_MOD_LINEAR &&
+         bo->modifiers[0] != DRM_FORMAT_MOD_INVALID;
+}
+
+// Gralloc allocates multi-planar buffers in one piece, only the stride of the
+// first plane is in the handle. YV12 is the one such format whose other planes
+// Android lays down, semi-planar chroma is assumed to follow luma right away.
+void DrmGenericImporter::SetPlaneLayout(hwc_drm_bo_t *bo, uint32_t stride) {
+  bo->pitches[0] = stride;
+  bo->offsets[0] = 0;
+
+  switch (bo->format) {
+    case DRM_FORMAT_YVU420:
+      // Chroma stride is aligned to 16 bytes, Cr comes before Cb
+      bo->pixel_stride = stride;
+      bo->pitches[1] = ((stride / 2) + 15) & ~15;
+      bo->pitches[2] = bo->pitches[1];
+      bo->offsets[1] = stride * bo->height;
+      bo->offsets[2] = bo->offsets[1] + bo->pitches[1] * (bo->height / 2);
+      break;
+    case DRM_FORMAT_NV12:
+    case DRM_FORMAT_NV21:
+      bo->pixel_stride = stride;
+      bo->pitches[1] = stride;
+      bo->offsets[1] = stride * bo->height;
+      break;
+    case DRM_FORMAT_P010:
+      bo->pixel_stride = stride / 2;
+      bo->pitches[1] = stride;
+      bo->offsets[1] = stride * bo->height;
+      break;
+    default:
+      bo->pixel_stride = (stride * 8) / DrmFormatToBitsPerPixel(bo->format);
+      break;
+  }
+}
+
+// static
+int DrmGenericImporter::SetYCbCrLayout(hwc_drm_bo_t *bo,
+                                       const android_ycbcr &ycbcr) {
+  // The planes are laid out from the start of the buffer
+  uintptr_t y = reinterpret_cast<uintptr_t>(ycbcr.y);
+  uintptr_t cb = reinterpret_cast<uintptr_t>(ycbcr.cb);
+  uintptr_t cr = reinterpret_cast<uintptr_t>(ycbcr.cr);
+  if (cb <= y || cr <= y)
+    return -EINVAL;
+
+  bool ten_bit = bo->hal_format == HAL_PIXEL_FORMAT_YCBCR_P010;
+  bo->pitches[0] = ycbcr.ystride;
+  bo->offsets[0] = 0;
+  switch (ycbcr.chroma_step) {
+    case 1:
+      if (ten_bit)
+        return -EINVAL;
+      bo->format = cb < cr ? DRM_FORMAT_YUV420 : DRM_FORMAT_YVU420;
+      bo->pixel_stride = ycbcr.ystride;
+      bo->pitches[1] = ycbcr.cstride;
+      bo->pitches[2] = ycbcr.cstride;
+      bo->offsets[1] = std::min(cb, cr) - y;
+      bo->offsets[2] = std::max(cb, cr) - y;
+      return 0;
+    case 2:
+      if (ten_bit || (cr != cb + 1 && cb != cr + 1))
+        return -EINVAL;
+      bo->format = cb < cr ? DRM_FORMAT_NV12 : DRM_FORMAT_NV21;
+      bo->pixel_stride = ycbcr.ystride;
+      bo->pitches[1] = ycbcr.cstride;
+      bo->offsets[1] = std::min(cb, cr) - y;
+      return 0;
+    case 4:
+      if (!ten_bit || cr != cb + 2)
+        return -EINVAL;
+      bo->format = DRM_FORMAT_P010;
+      bo->pixel_stride = ycbcr.ystride / 2;
+      bo->pitches[1] = ycbcr.cstride;
+      bo->offsets[1] = cb - y;
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+int DrmGenericImporter::GetYCbCrLayout(buffer_handle_t handle,
+                                       uint32_t stride, hwc_drm_bo_t *bo) {
+  LayoutKey key(bo->hal_format, bo->width, bo->height, stride);
+  {
+    std::lock_guard<std::mutex> lock(layouts_lock_);
+    auto it = layouts_.find(key);
+    if (it != layouts_.end()) {
+      bo->format = it->second.format;
+      bo->pixel_stride = it->second.pixel_stride;
+      memcpy(bo->pitches, it->second.pitches, sizeof(bo->pitches));
+      memcpy(bo->offsets, it->second.offsets, sizeof(bo->offsets));
+      return it->second.status;
+    }
+  }
+
+  // Locking maps the buffer, which gralloc refuses for protected content and
+  // may refuse for buffers the CPU has no access to
+  android_ycbcr ycbcr;
+  if ((bo->usage & GRALLOC_USAGE_PROTECTED) || !gralloc_ ||
+      !gralloc_->lock_ycbcr ||
+      gralloc_->lock_ycbcr(gralloc_, handle, GRALLOC_USAGE_SW_READ_RARELY, 0, 0,
+                           bo->width, bo->height, &ycbcr)) {
+    // Not remembered, a buffer alike which gralloc does lock may tell better
+    bo->format = ConvertHalFormatToDrm(bo->hal_format);
+    SetPlaneLayout(bo, stride);
+    return 0;
+  }
+  int ret = SetYCbCrLayout(bo, ycbcr);
+  gralloc_->unlock(gralloc_, handle);
+
+  Layout layout;
+  layout.status = ret;
+  layout.format = bo->format;
+  layout.pixel_stride = bo->pixel_stride;
+  memcpy(layout.pitches, bo->pitches, sizeof(layout.pitches));
+  memcpy(layout.offsets, bo->offsets, sizeof(layout.offsets));
+  std::lock_guard<std::mutex> lock(layouts_lock_);
+  layouts_[key] = layout;
+  return ret;
+}
+
 int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   gralloc_handle_t *gr_handle = gralloc_handle(handle);
   if (!gr_handle)
     return -EINVAL;
 
+  memset(bo, 0, sizeof(hwc_drm_bo_t));
+  bo->width = gr_handle->width;
+  bo->height = gr_handle->height;
+  bo->hal_format = gr_handle->format;
+  bo->usage = gr_handle->usage;
+  int ret;
+  switch (gr_handle->format) {
+    case HAL_PIXEL_FORMAT_YCBCR_420_888:
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+    case HAL_PIXEL_FORMAT_YCBCR_P010:
+      // Where the chroma planes are is up to gralloc, and 420_888 doesn't
+      // even say in what order
+      ret = GetYCbCrLayout(handle, gr_handle->stride, bo);
+      if (ret) {
+        ALOGE("Failed to get the layout of YUV buffer ret=%d", ret);
+        return ret;
+      }
+      break;
+    default:
+      bo->format = ConvertHalFormatToDrm(gr_handle->format);
+      SetPlaneLayout(bo, gr_handle->stride);
+      break;
+  }
+
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
+  ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
   if (ret) {
     ALOGE("failed to import prime fd %d ret=%d", gr_handle->prime_fd, ret);
     return ret;
   }
 
-  memset(bo, 0, sizeof(hwc_drm_bo_t));
-  bo->width = gr_handle->width;
-  bo->height = gr_handle->height;
-  bo->hal_format = gr_handle->format;
-  bo->format = ConvertHalFormatToDrm(gr_handle->format);
-  bo->usage = gr_handle->usage;
-  bo->pixel_stride = (gr_handle->stride * 8) /
-                     DrmFormatToBitsPerPixel(bo->format);
-  bo->pitches[0] = gr_handle->stride;
-  bo->gem_handles[0] = gem_handle;
-  bo->offsets[0] = 0;
+  for (int i = 0; i < HWC_DRM_BO_MAX_PLANES; i++) {
+    if (!bo->pitches[i])
+      break;
+    bo->gem_handles[i] = gem_handle;
+    bo->modifiers[i] = gr_handle->modifier;
+  }
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
+                                   bo->format, bo->gem_handles, bo->pitches,
+                                   bo->offsets, bo->modifiers, &bo->fb_id,
+                                   HasExplicitModifier(bo)
+                                       ? DRM_MODE_FB_MODIFIERS
+                                       : 0);
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
     return ret;
@@ -186,6 +348,7 @@ bool DrmGenericImporter::CanImportBuffer(buffer_handle_t handle) {
 #ifdef USE_DRM_GENERIC_IMPORTER
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
+  planner->AddStage<PlanStageCursor>();
   planner->AddStage<PlanStageGreedy>();
   return planner;
 }
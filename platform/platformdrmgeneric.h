@@ -22,6 +22,10 @@
 
 #include <hardware/gralloc.h>
 
+#include <map>
+#include <mutex>
+#include <tuple>
+
 namespace android {
 
 class DrmGenericImporter : public Importer {
@@ -37,13 +41,42 @@ class DrmGenericImporter : public Importer {
 
   uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
   uint32_t DrmFormatToBitsPerPixel(uint32_t drm_format);
+  void SetPlaneLayout(hwc_drm_bo_t *bo, uint32_t stride);
+  // Fills in the format and planes of a YUV buffer from the layout gralloc
+  // locked it with. Fails for layouts KMS has no format for.
+  static int SetYCbCrLayout(hwc_drm_bo_t *bo, const android_ycbcr &ycbcr);
+  // Fills in the format and planes of a YUV buffer whose HAL format, usage
+  // and size are set. Gralloc is asked once for buffers alike. Protected
+  // buffers, which it can't lock, are assumed to have chroma after luma unless
+  // a buffer alike told otherwise.
+  int GetYCbCrLayout(buffer_handle_t handle, uint32_t stride,
+                     hwc_drm_bo_t *bo);
+
+  // Whether the buffer layout has to be passed to KMS with the modifier, as
+  // opposed to being linear or implied by the driver
+  static bool HasExplicitModifier(const hwc_drm_bo_t *bo);
 
  protected:
   DrmDevice *drm_;
+  const gralloc_module_t *gralloc_;
 
  private:
-  const gralloc_module_t *gralloc_;
+  // HAL format, width, height and stride of the first plane, which the layout
+  // of the other planes follows from
+  typedef std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> LayoutKey;
+
+  struct Layout {
+    int status;
+    uint32_t format;
+    uint32_t pixel_stride;
+    uint32_t pitches[HWC_DRM_BO_MAX_PLANES];
+    uint32_t offsets[HWC_DRM_BO_MAX_PLANES];
+  };
+
   bool exclude_non_hwfb_;
+
+  std::mutex layouts_lock_;
+  std::map<LayoutKey, Layout> layouts_;
 };
 }  // namespace android
 
@@ -100,7 +100,7 @@ bool HisiImporter::IsDrmFormatRgb(uint32_t drm_format) {
 
 int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bool is_rgb;
-  uint64_t modifiers[4] = {0};
+  uint64_t modifier;
 
   memset(bo, 0, sizeof(hwc_drm_bo_t));
 
@@ -126,8 +126,7 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
     return fmt;
 
   is_rgb = IsDrmFormatRgb(fmt);
-  modifiers[0] = ConvertGrallocFormatToDrmModifiers(hnd->internal_format,
-                                                    is_rgb);
+  modifier = ConvertGrallocFormatToDrmModifiers(hnd->internal_format, is_rgb);
 
   bo->width = hnd->width;
   bo->height = hnd->height;
@@ -164,10 +163,13 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
       break;
   }
 
+  for (int i = 0; i < HWC_DRM_BO_MAX_PLANES && bo->gem_handles[i]; i++)
+    bo->modifiers[i] = modifier;
+
   ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
                                    bo->format, bo->gem_handles, bo->pitches,
-                                   bo->offsets, modifiers, &bo->fb_id,
-                                   modifiers[0] ? DRM_MODE_FB_MODIFIERS : 0);
+                                   bo->offsets, bo->modifiers, &bo->fb_id,
+                                   modifier ? DRM_MODE_FB_MODIFIERS : 0);
 
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
@@ -218,6 +220,7 @@ class PlanStageHiSi : public Planner::PlanStage {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
+  planner->AddStage<PlanStageCursor>();
   planner->AddStage<PlanStageHiSi>();
   return planner;
 }
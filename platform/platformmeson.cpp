@@ -76,8 +76,6 @@ uint64_t MesonImporter::ConvertGrallocFormatToDrmModifiers(
 #endif
 
 int MesonImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
-  uint64_t modifiers[4] = {0};
-
   memset(bo, 0, sizeof(hwc_drm_bo_t));
 
   private_handle_t const *hnd = reinterpret_cast<private_handle_t const *>(
@@ -101,8 +99,6 @@ int MesonImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   if (fmt < 0)
     return fmt;
 
-  modifiers[0] = ConvertGrallocFormatToDrmModifiers(hnd->internal_format);
-
   bo->width = hnd->width;
   bo->height = hnd->height;
   bo->hal_format = hnd->req_format;
@@ -112,11 +108,13 @@ int MesonImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->pitches[0] = hnd->byte_stride;
   bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
+  bo->modifiers[0] = ConvertGrallocFormatToDrmModifiers(hnd->internal_format);
 
   ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
                                    bo->format, bo->gem_handles, bo->pitches,
-                                   bo->offsets, modifiers, &bo->fb_id,
-                                   modifiers[0] ? DRM_MODE_FB_MODIFIERS : 0);
+                                   bo->offsets, bo->modifiers, &bo->fb_id,
+                                   bo->modifiers[0] ? DRM_MODE_FB_MODIFIERS
+                                                    : 0);
 
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
@@ -134,6 +132,7 @@ bool MesonImporter::CanImportBuffer(buffer_handle_t handle) {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
+  planner->AddStage<PlanStageCursor>();
   planner->AddStage<PlanStageGreedy>();
   return planner;
 }
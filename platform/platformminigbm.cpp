@@ -23,6 +23,7 @@
 #include <drm/drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <algorithm>
 
 #include <hardware/gralloc.h>
 #include <log/log.h>
@@ -50,13 +51,6 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   if (!gr_handle)
     return -EINVAL;
 
-  uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->fds[0], &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", gr_handle->fds[0], ret);
-    return ret;
-  }
-
   memset(bo, 0, sizeof(hwc_drm_bo_t));
   bo->width = gr_handle->width;
   bo->height = gr_handle->height;
@@ -64,14 +58,33 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->format = gr_handle->format;
   bo->usage = gr_handle->usage;
   bo->pixel_stride = gr_handle->pixel_stride;
-  bo->pitches[0] = gr_handle->strides[0];
-  bo->offsets[0] = gr_handle->offsets[0];
-  bo->gem_handles[0] = gem_handle;
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  // Compressed layouts may keep their metadata in a plane of its own
+  uint32_t num_planes = std::min<uint32_t>(gr_handle->num_planes,
+                                           HWC_DRM_BO_MAX_PLANES);
+  for (uint32_t i = 0; i < num_planes; i++) {
+    int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->fds[i],
+                                 &bo->gem_handles[i]);
+    if (ret) {
+      ALOGE("failed to import prime fd %d ret=%d", gr_handle->fds[i], ret);
+      ReleaseBuffer(bo);
+      return ret;
+    }
+    bo->pitches[i] = gr_handle->strides[i];
+    bo->offsets[i] = gr_handle->offsets[i];
+    bo->modifiers[i] = gr_handle->format_modifier;
+  }
+
+  int ret = drmModeAddFB2WithModifiers(drm_->fd(), bo->width, bo->height,
+                                       bo->format, bo->gem_handles,
+                                       bo->pitches, bo->offsets, bo->modifiers,
+                                       &bo->fb_id,
+                                       HasExplicitModifier(bo)
+                                           ? DRM_MODE_FB_MODIFIERS
+                                           : 0);
   if (ret) {
     ALOGE("could not create drm fb %d", ret);
+    ReleaseBuffer(bo);
     return ret;
   }
 
@@ -80,6 +93,7 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
+  planner->AddStage<PlanStageCursor>();
   planner->AddStage<PlanStageGreedy>();
   return planner;
 }
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include <cutils/native_handle.h>
+#include <ui/GraphicBuffer.h>
+
+#include "platformarmgr.h"
+
+using android::ArmgrBufferInfo;
+using android::ArmgrBufferInfoCache;
+using android::DrmBufferCache;
+using android::GraphicBuffer;
+using android::sp;
+
+struct ArmgrBufferInfoCacheTest : public testing::Test {
+ protected:
+  ArmgrBufferInfoCacheTest()
+      : cache([this](buffer_handle_t, ArmgrBufferInfo *info) {
+          // Stands in for the IAccessor queries
+          info->usage = ++queries;
+          return 0;
+        }, 2) {
+  }
+
+  void SetUp() {
+    for (int i = 0; i < 3; i++) {
+      buffers[i] = new GraphicBuffer(16, 16, HAL_PIXEL_FORMAT_RGBA_8888,
+                                     GRALLOC_USAGE_HW_COMPOSER);
+      ASSERT_EQ(0, buffers[i]->initCheck());
+    }
+  }
+
+  uint32_t queries = 0;
+  ArmgrBufferInfoCache cache;
+  sp<GraphicBuffer> buffers[3];
+  ArmgrBufferInfo info;
+  DrmBufferCache::BufferId id;
+};
+
+TEST_F(ArmgrBufferInfoCacheTest, QueriesOnce) {
+  native_handle_t *copy = native_handle_clone(buffers[0]->handle);
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(0, cache.Get(copy, &info, &id));
+  native_handle_close(copy);
+  native_handle_delete(copy);
+  ASSERT_EQ(1U, queries);
+  ASSERT_EQ(1U, info.usage);
+}
+
+TEST_F(ArmgrBufferInfoCacheTest, RequeriesAfterInvalidate) {
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  cache.Invalidate(id);
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(2U, queries);
+  ASSERT_EQ(2U, info.usage);
+}
+
+TEST_F(ArmgrBufferInfoCacheTest, EvictsLeastRecentlyUsed) {
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(0, cache.Get(buffers[1]->handle, &info, &id));
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(0, cache.Get(buffers[2]->handle, &info, &id));
+  ASSERT_EQ(3U, queries);
+  ASSERT_EQ(0, cache.Get(buffers[0]->handle, &info, &id));
+  ASSERT_EQ(3U, queries);
+  ASSERT_EQ(0, cache.Get(buffers[1]->handle, &info, &id));
+  ASSERT_EQ(4U, queries);
+}
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include <cutils/native_handle.h>
+#include <ui/GraphicBuffer.h>
+
+#include <memory>
+
+#include "drmbuffercache.h"
+#include "platform.h"
+
+using android::DrmBufferCache;
+using android::DrmHwcNativeHandle;
+using android::GraphicBuffer;
+using android::Importer;
+using android::sp;
+
+struct TestImporter : public Importer {
+  int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
+    memset(bo, 0, sizeof(*bo));
+    bo->width = 16;
+    bo->height = 16;
+    bo->hal_format = HAL_PIXEL_FORMAT_RGBA_8888;
+    bo->usage = GRALLOC_USAGE_HW_COMPOSER;
+    bo->pixel_stride = 16;
+    bo->gem_handles[0] = 1;
+    bo->fb_id = ++imported;
+    bo->priv = (void *)handle;
+    return 0;
+  }
+
+  int ReleaseBuffer(hwc_drm_bo_t *bo) {
+    released++;
+    last_released = bo->fb_id;
+    return 0;
+  }
+
+  bool CanImportBuffer(buffer_handle_t) {
+    return true;
+  }
+
+  uint32_t imported = 0;
+  uint32_t released = 0;
+  uint32_t last_released = 0;
+};
+
+struct DrmBufferCacheTest : public testing::Test {
+ protected:
+  void SetUp() {
+    cache = std::make_unique<DrmBufferCache>(&importer, nullptr, 2);
+    for (int i = 0; i < 3; i++) {
+      buffers[i] = new GraphicBuffer(16, 16, HAL_PIXEL_FORMAT_RGBA_8888,
+                                     GRALLOC_USAGE_HW_COMPOSER);
+      ASSERT_EQ(0, buffers[i]->initCheck());
+    }
+  }
+
+  void TearDown() {
+    cache.reset();
+  }
+
+  TestImporter importer;
+  std::unique_ptr<DrmBufferCache> cache;
+  sp<GraphicBuffer> buffers[3];
+  DrmHwcNativeHandle handle;
+  const int owner = 0;
+};
+
+TEST_F(DrmBufferCacheTest, ImportsOnce) {
+  std::shared_ptr<hwc_drm_bo_t> bo, bo2;
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo, &handle));
+  buffer_handle_t imported_handle = handle.get();
+  ASSERT_NE(nullptr, imported_handle);
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo2, &handle));
+  ASSERT_EQ(1U, importer.imported);
+  ASSERT_EQ(bo.get(), bo2.get());
+  ASSERT_EQ(imported_handle, handle.get());
+}
+
+TEST_F(DrmBufferCacheTest, MatchesNewHandleForSameBuffer) {
+  native_handle_t *copy = native_handle_clone(buffers[0]->handle);
+  std::shared_ptr<hwc_drm_bo_t> bo, bo2;
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(0, cache->ImportBuffer(copy, &owner, &bo2, &handle));
+  native_handle_close(copy);
+  native_handle_delete(copy);
+  ASSERT_EQ(1U, importer.imported);
+  ASSERT_EQ(bo.get(), bo2.get());
+}
+
+TEST_F(DrmBufferCacheTest, EvictsLeastRecentlyUsed) {
+  std::shared_ptr<hwc_drm_bo_t> bo;
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[1]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[2]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(2U, cache->size());
+  ASSERT_EQ(1U, importer.released);
+  ASSERT_EQ(2U, importer.last_released);
+}
+
+TEST_F(DrmBufferCacheTest, ReleasesAfterLastReference) {
+  const int other_owner = 0;
+  std::shared_ptr<hwc_drm_bo_t> bo, bo2;
+  ASSERT_EQ(0, cache->ImportBuffer(buffers[0]->handle, &owner, &bo, &handle));
+  ASSERT_EQ(0,
+            cache->ImportBuffer(buffers[1]->handle, &other_owner, &bo2, &handle));
+  cache->EvictOwner(&owner);
+  ASSERT_EQ(1U, cache->size());
+  ASSERT_EQ(0U, importer.released);
+  bo.reset();
+  ASSERT_EQ(1U, importer.released);
+  ASSERT_EQ(1U, importer.last_released);
+}
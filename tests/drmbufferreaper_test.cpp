@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "drmbufferreaper.h"
+#include "platform.h"
+
+using android::DrmBufferReaper;
+using android::Importer;
+
+struct CountingImporter : public Importer {
+  int ImportBuffer(buffer_handle_t, hwc_drm_bo_t *) {
+    return -EINVAL;
+  }
+
+  int ReleaseBuffer(hwc_drm_bo_t *) {
+    released++;
+    return 0;
+  }
+
+  bool CanImportBuffer(buffer_handle_t) {
+    return false;
+  }
+
+  std::atomic<int> released{0};
+};
+
+struct DrmBufferReaperTest : public testing::Test {
+ protected:
+  void SetUp() {
+    ASSERT_EQ(0, reaper.Init());
+  }
+
+  bool WaitForReleased(int count) {
+    for (int i = 0; i < 1000 && importer.released < count; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return importer.released == count;
+  }
+
+  CountingImporter importer;
+  DrmBufferReaper reaper;
+};
+
+TEST_F(DrmBufferReaperTest, ReleasesQueued) {
+  reaper.Queue(&importer, new hwc_drm_bo_t());
+  ASSERT_TRUE(WaitForReleased(1));
+  reaper.Queue(&importer, new hwc_drm_bo_t());
+  reaper.Queue(&importer, new hwc_drm_bo_t());
+  ASSERT_TRUE(WaitForReleased(3));
+}
+
+TEST_F(DrmBufferReaperTest, ConcurrentQueue) {
+  const int kThreads = 4, kBuffers = 256;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++)
+    threads.emplace_back([this] {
+      for (int j = 0; j < kBuffers; j++)
+        reaper.Queue(&importer, new hwc_drm_bo_t());
+    });
+  for (auto &thread : threads)
+    thread.join();
+  ASSERT_TRUE(WaitForReleased(kThreads * kBuffers));
+}
+
+TEST_F(DrmBufferReaperTest, ReleasesOnExit) {
+  {
+    DrmBufferReaper local_reaper;
+    local_reaper.Queue(&importer, new hwc_drm_bo_t());
+  }
+  ASSERT_EQ(1, importer.released);
+}
+
+TEST_F(DrmBufferReaperTest, RunsReleaseCallbacks) {
+  std::atomic<int> released{0};
+  reaper.Queue([&released] { released++; });
+  reaper.Queue(&importer, new hwc_drm_bo_t());
+  reaper.Queue([&released] { released++; });
+  ASSERT_TRUE(WaitForReleased(1));
+  for (int i = 0; i < 1000 && released < 2; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ASSERT_EQ(2, released);
+}
@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+
+#include "drmcommittedstate.h"
+
+using android::DrmCommittedState;
+
+namespace {
+
+// Builds a frame setting plane 31's FB_ID (10) and CRTC_X (11), returns how
+// many properties it carries
+int BuildFrame(DrmCommittedState *state, uint64_t fb_id,
+               DrmCommittedState::PropertyMap *pending) {
+  return state->Changed(31, 10, fb_id, pending) +
+         state->Changed(31, 11, 100, pending);
+}
+
+}  // namespace
+
+TEST(DrmCommittedStateTest, FirstFrameSendsEverything) {
+  DrmCommittedState state;
+  DrmCommittedState::PropertyMap pending;
+  EXPECT_EQ(2, BuildFrame(&state, 5, &pending));
+  EXPECT_EQ(2u, pending.size());
+}
+
+TEST(DrmCommittedStateTest, OnlyChangesAfterCommit) {
+  DrmCommittedState state;
+  DrmCommittedState::PropertyMap pending;
+  BuildFrame(&state, 5, &pending);
+  state.Commit(pending);
+
+  DrmCommittedState::PropertyMap next;
+  EXPECT_EQ(1, BuildFrame(&state, 6, &next));
+  ASSERT_EQ(1u, next.size());
+  EXPECT_EQ(6u, next.begin()->second);
+}
+
+TEST(DrmCommittedStateTest, UncommittedFrameIsNotRemembered) {
+  DrmCommittedState state;
+  DrmCommittedState::PropertyMap pending;
+  BuildFrame(&state, 5, &pending);
+
+  // The commit failed, so nothing was taken
+  DrmCommittedState::PropertyMap next;
+  EXPECT_EQ(2, BuildFrame(&state, 5, &next));
+}
+
+TEST(DrmCommittedStateTest, FrameAfterClearSendsEverything) {
+  DrmCommittedState state;
+  DrmCommittedState::PropertyMap pending;
+  BuildFrame(&state, 5, &pending);
+  state.Commit(pending);
+
+  // As after ClearDisplay, a modeset, DPMS or a failed commit
+  state.Clear();
+  EXPECT_TRUE(state.empty());
+  DrmCommittedState::PropertyMap next;
+  EXPECT_EQ(2, BuildFrame(&state, 5, &next));
+  EXPECT_EQ(pending, next);
+}
+
+TEST(DrmCommittedStateTest, NullPendingAlwaysSends) {
+  DrmCommittedState state;
+  DrmCommittedState::PropertyMap pending;
+  BuildFrame(&state, 5, &pending);
+  state.Commit(pending);
+
+  EXPECT_TRUE(state.Changed(31, 10, 5, NULL));
+}
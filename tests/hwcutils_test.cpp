@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <xf86drmMode.h>
+
+#include "drmhwcomposer.h"
+
+using android::DrmHwcBlending;
+using android::DrmHwcLayer;
+
+TEST(DrmHwcLayerTest, FillPixelPremultiplies) {
+  DrmHwcLayer layer;
+  layer.color = 0x80ff4000;
+  layer.blending = DrmHwcBlending::kCoverage;
+  ASSERT_EQ(0x80ff4000U, layer.FillPixel());
+  layer.blending = DrmHwcBlending::kPreMult;
+  ASSERT_EQ(0x80802000U, layer.FillPixel());
+}
+
+TEST(DrmHwcLayerTest, BackgroundColorBlendsOverBlack) {
+  DrmHwcLayer layer;
+  layer.color = 0x00ff0000;
+  layer.blending = DrmHwcBlending::kNone;
+  ASSERT_EQ(0xffffffff00000000U, layer.BackgroundColor());
+
+  layer.blending = DrmHwcBlending::kPreMult;
+  ASSERT_EQ(0xffff000000000000U, layer.BackgroundColor());
+
+  layer.color = 0xff00ff00;
+  layer.alpha = 0x8000;
+  ASSERT_EQ(0xffff000080000000U, layer.BackgroundColor());
+}
+
+TEST(DrmHwcLayerTest, IsScaled) {
+  DrmHwcLayer layer;
+  layer.transform = android::DrmHwcTransform::kIdentity;
+  layer.source_crop = {0, 0, 64, 32};
+  layer.display_frame = {100, 100, 164, 132};
+  ASSERT_FALSE(layer.IsScaled());
+
+  layer.transform = android::DrmHwcTransform::kRotate90;
+  ASSERT_TRUE(layer.IsScaled());
+  layer.display_frame = {100, 100, 132, 164};
+  ASSERT_FALSE(layer.IsScaled());
+
+  layer.transform = android::DrmHwcTransform::kIdentity;
+  layer.source_crop = {0, 0, 16, 16};
+  layer.display_frame = {0, 0, 1920, 1080};
+  ASSERT_TRUE(layer.IsScaled());
+}
+
+TEST(DrmHwcLayerTest, CropToFrameScalesCrop) {
+  DrmHwcLayer layer;
+  layer.transform = android::DrmHwcTransform::kIdentity;
+  layer.display_frame = {0, 0, 200, 100};
+  layer.source_crop = {0.0f, 0.0f, 100.0f, 50.0f};
+  layer.CropToFrame({50, 0, 300, 50});
+  ASSERT_EQ(50, layer.display_frame.left);
+  ASSERT_EQ(200, layer.display_frame.right);
+  ASSERT_EQ(50, layer.display_frame.bottom);
+  ASSERT_FLOAT_EQ(25.0f, layer.source_crop.left);
+  ASSERT_FLOAT_EQ(100.0f, layer.source_crop.right);
+  ASSERT_FLOAT_EQ(25.0f, layer.source_crop.bottom);
+
+  layer.transform = android::DrmHwcTransform::kRotate90;
+  layer.CropToFrame({0, 0, 100, 10});
+  ASSERT_EQ(50, layer.display_frame.left);
+}
+
+TEST(DrmHwcLayerTest, DrmRotation) {
+  DrmHwcLayer layer;
+  layer.SetTransform(HWC_TRANSFORM_ROT_90 | HWC_TRANSFORM_FLIP_H);
+  ASSERT_EQ(static_cast<uint64_t>(DRM_MODE_ROTATE_90 | DRM_MODE_REFLECT_X),
+            layer.GetDrmRotation());
+  layer.SetTransform(0);
+  ASSERT_EQ(static_cast<uint64_t>(DRM_MODE_ROTATE_0), layer.GetDrmRotation());
+}
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <ui/GraphicBuffer.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "drmbuffercache.h"
+#include "importworker.h"
+#include "platform.h"
+
+using android::DrmBufferCache;
+using android::DrmHwcNativeHandle;
+using android::GraphicBuffer;
+using android::ImportWorker;
+using android::Importer;
+using android::sp;
+
+struct SlowImporter : public Importer {
+  int ImportBuffer(buffer_handle_t /*handle*/, hwc_drm_bo_t *bo) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    memset(bo, 0, sizeof(*bo));
+    bo->fb_id = ++imported;
+    return 0;
+  }
+
+  int ReleaseBuffer(hwc_drm_bo_t * /*bo*/) {
+    return 0;
+  }
+
+  bool CanImportBuffer(buffer_handle_t) {
+    return true;
+  }
+
+  std::atomic<uint32_t> imported{0};
+};
+
+struct ImportWorkerTest : public testing::Test {
+ protected:
+  void SetUp() {
+    cache = std::make_shared<DrmBufferCache>(&importer, nullptr, 4);
+    ASSERT_EQ(0, worker.Init(cache));
+    buffer = new GraphicBuffer(16, 16, HAL_PIXEL_FORMAT_RGBA_8888,
+                               GRALLOC_USAGE_HW_COMPOSER);
+    ASSERT_EQ(0, buffer->initCheck());
+  }
+
+  void TearDown() {
+    worker.Exit();
+  }
+
+  SlowImporter importer;
+  std::shared_ptr<DrmBufferCache> cache;
+  ImportWorker worker;
+  sp<GraphicBuffer> buffer;
+  const int owner = 0;
+};
+
+TEST_F(ImportWorkerTest, FillsCache) {
+  ASSERT_EQ(0, worker.Queue(buffer->handle, &owner));
+  for (int i = 0; i < 100 && !cache->size(); i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  ASSERT_EQ(1U, cache->size());
+  ASSERT_EQ(1U, importer.imported);
+}
+
+TEST_F(ImportWorkerTest, CompositionSharesPendingImport) {
+  ASSERT_EQ(0, worker.Queue(buffer->handle, &owner));
+  std::shared_ptr<hwc_drm_bo_t> bo;
+  DrmHwcNativeHandle handle;
+  ASSERT_EQ(0, cache->ImportBuffer(buffer->handle, &owner, &bo, &handle));
+  worker.Cancel(&owner);
+  ASSERT_EQ(1U, importer.imported);
+}
@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+#include <drm/drm_fourcc.h>
+#include <system/graphics.h>
+
+#include "platformdrmgeneric.h"
+
+using android::DrmGenericImporter;
+
+struct DrmGenericImporterTest : public testing::Test {
+ protected:
+  DrmGenericImporterTest() : importer(NULL) {
+  }
+
+  void Layout(uint32_t hal_format, uint32_t width, uint32_t height,
+              uint32_t stride) {
+    memset(&bo, 0, sizeof(bo));
+    bo.width = width;
+    bo.height = height;
+    bo.hal_format = hal_format;
+    bo.format = importer.ConvertHalFormatToDrm(hal_format);
+    importer.SetPlaneLayout(&bo, stride);
+  }
+
+  DrmGenericImporter importer;
+  hwc_drm_bo_t bo;
+};
+
+TEST_F(DrmGenericImporterTest, SinglePlane) {
+  Layout(HAL_PIXEL_FORMAT_RGBA_8888, 100, 50, 512);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_ABGR8888, bo.format);
+  ASSERT_EQ(128U, bo.pixel_stride);
+  ASSERT_EQ(512U, bo.pitches[0]);
+  ASSERT_EQ(0U, bo.pitches[1]);
+}
+
+TEST_F(DrmGenericImporterTest, YV12) {
+  Layout(HAL_PIXEL_FORMAT_YV12, 200, 100, 208);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_YVU420, bo.format);
+  ASSERT_EQ(208U, bo.pixel_stride);
+  ASSERT_EQ(112U, bo.pitches[1]);
+  ASSERT_EQ(112U, bo.pitches[2]);
+  ASSERT_EQ(208U * 100, bo.offsets[1]);
+  ASSERT_EQ(208U * 100 + 112U * 50, bo.offsets[2]);
+}
+
+TEST_F(DrmGenericImporterTest, SemiPlanar) {
+  Layout(HAL_PIXEL_FORMAT_YCBCR_420_888, 200, 100, 256);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV12, bo.format);
+  ASSERT_EQ(256U, bo.pixel_stride);
+  ASSERT_EQ(256U, bo.pitches[1]);
+  ASSERT_EQ(256U * 100, bo.offsets[1]);
+  ASSERT_EQ(0U, bo.pitches[2]);
+
+  Layout(HAL_PIXEL_FORMAT_YCRCB_420_SP, 200, 100, 256);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV21, bo.format);
+
+  Layout(HAL_PIXEL_FORMAT_YCBCR_P010, 200, 100, 512);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_P010, bo.format);
+  ASSERT_EQ(256U, bo.pixel_stride);
+  ASSERT_EQ(512U, bo.pitches[1]);
+  ASSERT_EQ(512U * 100, bo.offsets[1]);
+}
+
+struct YCbCrLayoutTest : public testing::Test {
+ protected:
+  int Layout(uint32_t hal_format, size_t cb, size_t cr, size_t ystride,
+             size_t cstride, size_t chroma_step) {
+    memset(&bo, 0, sizeof(bo));
+    bo.hal_format = hal_format;
+    android_ycbcr ycbcr;
+    memset(&ycbcr, 0, sizeof(ycbcr));
+    ycbcr.y = buffer;
+    ycbcr.cb = buffer + cb;
+    ycbcr.cr = buffer + cr;
+    ycbcr.ystride = ystride;
+    ycbcr.cstride = cstride;
+    ycbcr.chroma_step = chroma_step;
+    return DrmGenericImporter::SetYCbCrLayout(&bo, ycbcr);
+  }
+
+  uint8_t buffer[64 * 64 * 2];
+  hwc_drm_bo_t bo;
+};
+
+TEST_F(YCbCrLayoutTest, SemiPlanar) {
+  ASSERT_EQ(0, Layout(HAL_PIXEL_FORMAT_YCBCR_420_888, 64 * 40, 64 * 40 + 1, 64,
+                      64, 2));
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV12, bo.format);
+  ASSERT_EQ(64U, bo.pixel_stride);
+  ASSERT_EQ(64U, bo.pitches[1]);
+  ASSERT_EQ(64U * 40, bo.offsets[1]);
+  ASSERT_EQ(0U, bo.pitches[2]);
+
+  ASSERT_EQ(0, Layout(HAL_PIXEL_FORMAT_YCRCB_420_SP, 64 * 32 + 1, 64 * 32, 64,
+                      64, 2));
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV21, bo.format);
+  ASSERT_EQ(64U * 32, bo.offsets[1]);
+}
+
+TEST_F(YCbCrLayoutTest, Planar) {
+  ASSERT_EQ(0, Layout(HAL_PIXEL_FORMAT_YCBCR_420_888, 64 * 32,
+                      64 * 32 + 32 * 16, 64, 32, 1));
+  ASSERT_EQ((uint32_t)DRM_FORMAT_YUV420, bo.format);
+  ASSERT_EQ(32U, bo.pitches[1]);
+  ASSERT_EQ(32U, bo.pitches[2]);
+  ASSERT_EQ(64U * 32, bo.offsets[1]);
+  ASSERT_EQ(64U * 32 + 32U * 16, bo.offsets[2]);
+}
+
+TEST_F(YCbCrLayoutTest, P010) {
+  ASSERT_EQ(0, Layout(HAL_PIXEL_FORMAT_YCBCR_P010, 128 * 32, 128 * 32 + 2, 128,
+                      128, 4));
+  ASSERT_EQ((uint32_t)DRM_FORMAT_P010, bo.format);
+  ASSERT_EQ(64U, bo.pixel_stride);
+  ASSERT_EQ(128U, bo.pitches[1]);
+  ASSERT_EQ(128U * 32, bo.offsets[1]);
+}
+
+TEST_F(YCbCrLayoutTest, Unsupported) {
+  // Chroma planes that aren't interleaved byte by byte
+  ASSERT_NE(0, Layout(HAL_PIXEL_FORMAT_YCBCR_420_888, 64 * 32, 64 * 48, 64, 64,
+                      2));
+  // 8 bit samples in a P010 buffer
+  ASSERT_NE(0, Layout(HAL_PIXEL_FORMAT_YCBCR_P010, 128 * 32, 128 * 32 + 1, 128,
+                      128, 2));
+}
+
+// Chroma of 64x32 NV12 buffers starts at row 48
+struct FakeGralloc {
+  static int LockYCbCr(const gralloc_module_t * /*module*/,
+                       buffer_handle_t /*handle*/, int /*usage*/, int /*l*/,
+                       int /*t*/, int /*w*/, int /*h*/, android_ycbcr *ycbcr) {
+    ++locks;
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = buffer;
+    ycbcr->cb = buffer + 64 * 48;
+    ycbcr->cr = buffer + 64 * 48 + 1;
+    ycbcr->ystride = 64;
+    ycbcr->cstride = 64;
+    ycbcr->chroma_step = 2;
+    return 0;
+  }
+  static int Unlock(const gralloc_module_t * /*module*/,
+                    buffer_handle_t /*handle*/) {
+    return 0;
+  }
+
+  static int locks;
+  static uint8_t buffer[64 * 48 * 2];
+};
+
+int FakeGralloc::locks;
+uint8_t FakeGralloc::buffer[64 * 48 * 2];
+
+class FakeGrallocImporter : public DrmGenericImporter {
+ public:
+  FakeGrallocImporter() : DrmGenericImporter(NULL) {
+    memset(&module_, 0, sizeof(module_));
+    module_.lock_ycbcr = FakeGralloc::LockYCbCr;
+    module_.unlock = FakeGralloc::Unlock;
+    gralloc_ = &module_;
+    FakeGralloc::locks = 0;
+  }
+
+ private:
+  gralloc_module_t module_;
+};
+
+struct GetYCbCrLayoutTest : public testing::Test {
+ protected:
+  int Layout(uint32_t usage) {
+    memset(&bo, 0, sizeof(bo));
+    bo.width = 64;
+    bo.height = 32;
+    bo.hal_format = HAL_PIXEL_FORMAT_YCBCR_420_888;
+    bo.usage = usage;
+    return importer.GetYCbCrLayout(NULL, 64, &bo);
+  }
+
+  FakeGrallocImporter importer;
+  hwc_drm_bo_t bo;
+};
+
+TEST_F(GetYCbCrLayoutTest, LocksOnceForBuffersAlike) {
+  ASSERT_EQ(0, Layout(0));
+  ASSERT_EQ(0, Layout(0));
+  ASSERT_EQ(1, FakeGralloc::locks);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV12, bo.format);
+  ASSERT_EQ(64U * 48, bo.offsets[1]);
+}
+
+TEST_F(GetYCbCrLayoutTest, ProtectedBufferIsNotLocked) {
+  ASSERT_EQ(0, Layout(GRALLOC_USAGE_PROTECTED));
+  ASSERT_EQ(0, FakeGralloc::locks);
+  ASSERT_EQ((uint32_t)DRM_FORMAT_NV12, bo.format);
+  ASSERT_EQ(64U * 32, bo.offsets[1]);
+}
+
+TEST_F(GetYCbCrLayoutTest, ProtectedBufferTakesLayoutOfBufferAlike) {
+  ASSERT_EQ(0, Layout(0));
+  ASSERT_EQ(0, Layout(GRALLOC_USAGE_PROTECTED));
+  ASSERT_EQ(1, FakeGralloc::locks);
+  ASSERT_EQ(64U * 48, bo.offsets[1]);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-buffer-cache"
+
+#include "drmbuffercache.h"
+#include "drmhwcomposer.h"
+#include "platform.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <log/log.h>
+
+namespace android {
+
+int DrmBufferCache::GetBufferId(buffer_handle_t handle, BufferId *id) {
+  if (!handle || handle->numFds < 1)
+    return -EINVAL;
+
+  struct stat st;
+  if (fstat(handle->data[0], &st)) {
+    ALOGE("Failed to stat buffer fd %d", errno);
+    return -errno;
+  }
+  *id = BufferId(st.st_dev, st.st_ino);
+  return 0;
+}
+
+DrmBufferCache::DrmBufferCache(Importer *importer, DrmBufferReaper *reaper,
+                               size_t max_size)
+    : importer_(importer), reaper_(reaper), max_size_(max_size) {
+}
+
+DrmBufferCache::~DrmBufferCache() {
+  Clear();
+}
+
+int DrmBufferCache::ImportBuffer(buffer_handle_t handle, const void *owner,
+                                 std::shared_ptr<hwc_drm_bo_t> *bo,
+                                 DrmHwcNativeHandle *native_handle) {
+  Key key;
+  int ret = GetBufferId(handle, &key);
+  if (ret)
+    return ret;
+
+  // Dropped outside the lock, releasing a buffer is an ioctl too
+  std::vector<Entry> evicted;
+  std::unique_lock<std::mutex> lock(lock_);
+  // Another thread (usually the import worker) may be importing this buffer
+  // already, wait for it rather than importing it twice
+  pending_cond_.wait(lock, [&] { return !pending_.count(key); });
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    it->second.owner = owner;
+    *bo = it->second.bo;
+    *native_handle = it->second.handle;
+    return 0;
+  }
+  pending_.insert(key);
+  lock.unlock();
+
+  // Import without holding the lock, the ioctls can take a while
+  std::shared_ptr<hwc_drm_bo_t> imported;
+  DrmHwcNativeHandle imported_handle;
+  hwc_drm_bo_t tmp_bo;
+  ret = importer_->ImportBuffer(handle, &tmp_bo);
+  if (!ret) {
+    imported.reset(new hwc_drm_bo_t(tmp_bo),
+                   DrmHwcBoReleaser{importer_, reaper_});
+    ret = imported_handle.CopyBufferHandle(handle, imported.get());
+    if (ret)
+      imported.reset();
+  }
+
+  lock.lock();
+  pending_.erase(key);
+  pending_cond_.notify_all();
+  if (ret)
+    return ret;
+
+  lru_.push_front(key);
+  entries_[key] = Entry{imported, imported_handle, owner, lru_.begin()};
+  while (entries_.size() > max_size_) {
+    auto last = entries_.find(lru_.back());
+    evicted.emplace_back(std::move(last->second));
+    entries_.erase(last);
+    lru_.pop_back();
+  }
+  *bo = std::move(imported);
+  *native_handle = std::move(imported_handle);
+  return 0;
+}
+
+void DrmBufferCache::EvictOwner(const void *owner) {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.owner != owner) {
+      ++it;
+      continue;
+    }
+    lru_.erase(it->second.lru);
+    evicted.emplace_back(std::move(it->second));
+    it = entries_.erase(it);
+  }
+}
+
+void DrmBufferCache::Clear() {
+  std::map<Key, Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  evicted.swap(entries_);
+  lru_.clear();
+}
+
+size_t DrmBufferCache::size() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return entries_.size();
+}
+}  // namespace android
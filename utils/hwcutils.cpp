@@ -17,28 +17,41 @@
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #define LOG_TAG "hwc-drm-utils"
 
+#include "drmbuffercache.h"
+#include "drmbufferreaper.h"
+#include "drmfillbufferpool.h"
 #include "drmhwcomposer.h"
 #include "platform.h"
 
+#include <algorithm>
+#include <utility>
+
 #include <log/log.h>
 #include <ui/GraphicBufferMapper.h>
+#include <xf86drmMode.h>
 
 namespace android {
 
+void DrmHwcBoReleaser::operator()(hwc_drm_bo_t *bo) const {
+  if (reaper) {
+    reaper->Queue(importer, bo);
+    return;
+  }
+  importer->ReleaseBuffer(bo);
+  delete bo;
+}
+
 const hwc_drm_bo *DrmHwcBuffer::operator->() const {
-  if (importer_ == NULL) {
+  if (bo_ == NULL) {
     ALOGE("Access of non-existent BO");
     exit(1);
     return NULL;
   }
-  return &bo_;
+  return bo_.get();
 }
 
 void DrmHwcBuffer::Clear() {
-  if (importer_ != NULL) {
-    importer_->ReleaseBuffer(&bo_);
-    importer_ = NULL;
-  }
+  bo_.reset();
 }
 
 int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
@@ -48,17 +61,21 @@ int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
   if (ret)
     return ret;
 
-  if (importer_ != NULL) {
-    importer_->ReleaseBuffer(&bo_);
-  }
-
-  importer_ = importer;
-
-  bo_ = tmp_bo;
+  bo_.reset(new hwc_drm_bo(tmp_bo), DrmHwcBoReleaser{importer});
 
   return 0;
 }
 
+DrmHwcNativeHandle::DrmHwcNativeHandle(native_handle_t *handle)
+    : handle_(handle, [](native_handle_t *handle) {
+        GraphicBufferMapper &gm(GraphicBufferMapper::get());
+        int ret = gm.freeBuffer(handle);
+        if (ret) {
+          ALOGE("Failed to free buffer handle %d", ret);
+        }
+      }) {
+}
+
 int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle, int width,
                                          int height, int layerCount, int format,
                                          int usage, int stride) {
@@ -83,26 +100,20 @@ int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle, int width,
     return ret;
   }
 
-  Clear();
-
-  handle_ = handle_copy;
+  *this = DrmHwcNativeHandle(handle_copy);
 
   return 0;
 }
 
-DrmHwcNativeHandle::~DrmHwcNativeHandle() {
-  Clear();
+int DrmHwcNativeHandle::CopyBufferHandle(buffer_handle_t handle,
+                                         const hwc_drm_bo_t *bo) {
+  // Layers as in array layers, not planes, the importers deal with 2D buffers
+  return CopyBufferHandle(handle, bo->width, bo->height, 1, bo->hal_format,
+                          bo->usage, bo->pixel_stride);
 }
 
 void DrmHwcNativeHandle::Clear() {
-  if (handle_ != NULL) {
-    GraphicBufferMapper &gm(GraphicBufferMapper::get());
-    int ret = gm.freeBuffer(handle_);
-    if (ret) {
-      ALOGE("Failed to free buffer handle %d", ret);
-    }
-    handle_ = NULL;
-  }
+  handle_.reset();
 }
 
 int DrmHwcLayer::ImportBuffer(Importer *importer) {
@@ -110,23 +121,100 @@ int DrmHwcLayer::ImportBuffer(Importer *importer) {
   if (ret)
     return ret;
 
-  const hwc_drm_bo *bo = buffer.operator->();
+  ret = handle.CopyBufferHandle(sf_handle, buffer.operator->());
+  if (ret)
+    return ret;
+
+  gralloc_buffer_usage = buffer->usage;
+
+  return 0;
+}
+
+int DrmHwcLayer::ImportBuffer(DrmBufferCache *cache, const void *owner) {
+  std::shared_ptr<hwc_drm_bo> bo;
+
+  int ret = cache->ImportBuffer(sf_handle, owner, &bo, &handle);
+  if (ret)
+    return ret;
+
+  buffer = DrmHwcBuffer(std::move(bo));
+  gralloc_buffer_usage = buffer->usage;
+
+  return 0;
+}
+
+int DrmHwcLayer::ImportFillBuffer(DrmFillBufferPool *pool) {
+  std::shared_ptr<hwc_drm_bo> bo;
 
-  unsigned int layer_count;
-  for (layer_count = 0; layer_count < HWC_DRM_BO_MAX_PLANES; ++layer_count)
-    if (bo->gem_handles[layer_count] == 0)
-      break;
+  int width = display_frame.right - display_frame.left;
+  int height = display_frame.bottom - display_frame.top;
+  if (width <= 0 || height <= 0)
+    return -EINVAL;
 
-  ret = handle.CopyBufferHandle(sf_handle, bo->width, bo->height, layer_count,
-                                bo->hal_format, bo->usage, bo->pixel_stride);
+  int ret = pool->GetBuffer(FillPixel(), width, height, &bo);
   if (ret)
     return ret;
 
-  gralloc_buffer_usage = bo->usage;
+  buffer = DrmHwcBuffer(std::move(bo));
+  // Whatever SurfaceFlinger set, the frame is filled from a buffer at least
+  // as large, so no plane has to scale it
+  source_crop = {0, 0, (float)width, (float)height};
+  transform = DrmHwcTransform::kIdentity;
 
   return 0;
 }
 
+bool DrmHwcLayer::IsScaled() const {
+  float width = source_crop.right - source_crop.left;
+  float height = source_crop.bottom - source_crop.top;
+  if (transform & (DrmHwcTransform::kRotate90 | DrmHwcTransform::kRotate270))
+    std::swap(width, height);
+  return width != display_frame.right - display_frame.left ||
+         height != display_frame.bottom - display_frame.top;
+}
+
+uint64_t DrmHwcLayer::GetDrmRotation() const {
+  uint64_t rotation = 0;
+  if (transform & DrmHwcTransform::kFlipH)
+    rotation |= DRM_MODE_REFLECT_X;
+  if (transform & DrmHwcTransform::kFlipV)
+    rotation |= DRM_MODE_REFLECT_Y;
+  if (transform & DrmHwcTransform::kRotate90)
+    rotation |= DRM_MODE_ROTATE_90;
+  else if (transform & DrmHwcTransform::kRotate180)
+    rotation |= DRM_MODE_ROTATE_180;
+  else if (transform & DrmHwcTransform::kRotate270)
+    rotation |= DRM_MODE_ROTATE_270;
+  else
+    rotation |= DRM_MODE_ROTATE_0;
+  return rotation;
+}
+
+uint32_t DrmHwcLayer::FillPixel() const {
+  if (blending != DrmHwcBlending::kPreMult)
+    return color;
+
+  uint32_t a = color >> 24;
+  uint32_t pixel = a << 24;
+  for (int shift = 0; shift < 24; shift += 8)
+    pixel |= (((color >> shift) & 0xff) * a / 0xff) << shift;
+  return pixel;
+}
+
+uint64_t DrmHwcLayer::BackgroundColor() const {
+  float a = alpha / 65535.0f;
+  if (blending != DrmHwcBlending::kNone)
+    a *= (color >> 24) / 255.0f;
+
+  uint64_t background = kDefaultBackgroundColor;
+  for (int shift = 0; shift < 24; shift += 8) {
+    float channel = ((color >> shift) & 0xff) / 255.0f;
+    background |= static_cast<uint64_t>(channel * a * 65535.0f + 0.5f)
+                  << (shift * 2);
+  }
+  return background;
+}
+
 int DrmHwcLayer::InitFromDrmHwcLayer(DrmHwcLayer *src_layer,
                                      Importer *importer) {
   blending = src_layer->blending;
@@ -147,6 +235,31 @@ void DrmHwcLayer::SetDisplayFrame(hwc_rect_t const &frame) {
   display_frame = frame;
 }
 
+void DrmHwcLayer::CropToFrame(hwc_rect_t const &frame) {
+  if (transform != DrmHwcTransform::kIdentity)
+    return;
+
+  hwc_rect_t cropped = {std::max(display_frame.left, frame.left),
+                        std::max(display_frame.top, frame.top),
+                        std::min(display_frame.right, frame.right),
+                        std::min(display_frame.bottom, frame.bottom)};
+  if (cropped.left >= cropped.right || cropped.top >= cropped.bottom)
+    return;
+
+  float scale_x = (source_crop.right - source_crop.left) /
+                  (display_frame.right - display_frame.left);
+  float scale_y = (source_crop.bottom - source_crop.top) /
+                  (display_frame.bottom - display_frame.top);
+  source_crop = {source_crop.left +
+                     (cropped.left - display_frame.left) * scale_x,
+                 source_crop.top + (cropped.top - display_frame.top) * scale_y,
+                 source_crop.left +
+                     (cropped.right - display_frame.left) * scale_x,
+                 source_crop.top +
+                     (cropped.bottom - display_frame.top) * scale_y};
+  display_frame = cropped;
+}
+
 void DrmHwcLayer::SetTransform(int32_t sf_transform) {
   transform = 0;
   // 270* and 180* cannot be combined with flips. More specifically, they